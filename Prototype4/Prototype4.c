@@ -1,137 +1,393 @@
 #define F_CPU 14745600 // Defining the microprocessor frequency
-#include <avr/io.h>
-#include <avr/interrupt.h>
-#include <util/delay.h>
+#include "hal.h"	// Including the register access of the AVR, or the model of it on the host
 #include "lcd.h"	// Including the LCD header file for displaying various variables
-#include <math.h>	// Including the math header file for mathematical functions
-
-#define pi 3.14157
+#include "motor.h"	// Including the TIMER5 motor driver
+#include "scheduler.h"	// Including the cooperative scheduler run from the TIMER2 tick
+#include "seqlock.h"	// Including the sequence counters for data shared with the interrupts
+#include "encoder.h"	// Including the timestamped shaft encoder edges
+#include "speed.h"	// Including the wheel speed controllers
+#include "profile.h"	// Including the trapezoidal speed profile
+#include <math.h>	// Including the math header file for the tables computed while building
+#include "sharp.h"	// Including the distance lookup tables of the Sharp sensors
+#include "heading.h"	// Including the fixed point heading units and sine table
+#include "field.h"	// Including the polar obstacle field of all the range sensors
+#include "grid.h"	// Including the occupancy grid map built from the Sharp sensors
+#include "planner.h"	// Including the A* route planner over the occupancy grid
+#include "trail.h"	// Including the simplified breadcrumb trail of the nodes
 
 /*****************
-Defining the volatile global variables for the both position encoder values.
+Defining the global variables for the both position encoders.
+The interrupts keep a running count and the edge timestamps of each wheel (see encoder.h).
+The shaft counters used by the motions are the counts since reset_shaft_counters; resetting only
+takes a snapshot of the running counts, so the main loop never writes what the interrupts write.
 ******************/
 //------------------------------------------------------------------------------------
-volatile int Shaft_Counter_Right_Wheel = 0;
-volatile int Shaft_Counter_Left_Wheel = 0;
+wheel_encoder left_encoder = ENCODER_INIT;
+wheel_encoder right_encoder = ENCODER_INIT;
+
+unsigned int shaft_base_left = 0, shaft_base_right = 0;
 //------------------------------------------------------------------------------------
 
 
 /*
-reference_distance - A Global Variable to store the minimum allowed distance from the Sharp sensor to any obstacle.
-current_x , current_y - Global Variables to store real life spatial coordinates
-init_x, init_y - GLobal Variables to store the previous node's x and y spatial coordinates.
+reference_distance - A Global Variable to store the minimum allowed distance (in mm) from the Sharp sensor to any obstacle.
+current_x , current_y - Global Variables to store real life spatial coordinates, in 1/256 cm (see heading.h).
+				The pose is written by the odometry interrupt only, under pose_sequence, and is read with get_pose.
 current_theta - A Global Variable that stores the current direction in terms of the angle with the
-				Y - Axis.
+				Y - Axis, in heading units (1408 for 360 degrees, see heading.h).
 */
 //------------------------------------------------------------------------------------
-double reference_distance=100;
-double current_x=0,current_y=0,current_theta = 0;
-double init_x=0, init_y=0;
-unsigned char data;
+unsigned int reference_distance=100;
+volatile long current_x=0,current_y=0;
+volatile int current_theta = 0;
+seqlock pose_sequence = 0;
 //------------------------------------------------------------------------------------
 
+void avoid_begin();
+void get_pose(long *x, long *y, int *theta);
+void move_done(unsigned char sequence);
+void move_aborted(unsigned char sequence);
+void odometry_set_steer(int left, int right);
+extern volatile unsigned char odometry_slips;
+extern unsigned char avoid_give_ups;
+extern unsigned char command_crc_errors;
+
+// Indices of the scheduler tasks in sched_tasks
+#define TASK_FIELD     0
+#define TASK_FOLLOW    1
+#define TASK_SPEED     2
+#define TASK_OBSTACLE  3
+#define TASK_AVOID     4
+#define TASK_GRID      5
+#define TASK_PLAN      6
+#define TASK_COMMAND   7
+#define TASK_TELEMETRY 8
+#define TASK_DISPLAY   9
+#define TASK_LCD       10
 
 
-//Function to configure INT4 (PORTE 4) pin as input for the left position encoder
-//------------------------------------------------------------------------------------
-void Left_Encoder_Pin_Configuration(void)
+
+//Functions for incrementing the Shaft Encoder Values
+//--------------------------------------------------------
+/*
+Stop target.
+A motion arms a target for the sum of both shaft counters with arm_stop_target. The encoder interrupts
+compare the running counts with it on every edge and stop the motors themselves as soon as it is
+reached, then raise stop_target_reached for the waiting motion. The stop lands on the edge that reaches
+the target, a few microseconds late at most, whatever the main loop is doing at the time.
+*/
+volatile unsigned char stop_target_armed = 0, stop_target_reached = 0;
+volatile unsigned int stop_target = 0;
+
+void check_stop_target()
+{
+    if(stop_target_armed && (unsigned int)(left_encoder.ticks + right_encoder.ticks - stop_target) < 0x8000)
+    {
+        hal_motor_direction(0x00);  // Same as stop_motion
+        stop_target_armed = 0;
+        stop_target_reached = 1;
+    }
+}
+
+HAL_ISR(INT4)
+{
+    encoder_edge(&left_encoder);
+    check_stop_target();
+}
+
+HAL_ISR(INT5)
+{
+    encoder_edge(&right_encoder);
+    check_stop_target();
+}
+
+// Function to start the shaft counters from zero
+void reset_shaft_counters()
+{
+    shaft_base_left = encoder_ticks(&left_encoder);
+    shaft_base_right = encoder_ticks(&right_encoder);
+}
+
+// Function to stop the motors from the encoder interrupts when the sum of the shaft counters reaches "counts"
+void arm_stop_target(int counts)
 {
-    DDRE  = DDRE & 0xEF;  //Set the direction of the PORTE 4 pin as input
-    PORTE = PORTE | 0x10; //Enable internal pull-up for PORTE 4 pin
+    stop_target_armed = 0;
+    stop_target = shaft_base_left + shaft_base_right + counts;
+    stop_target_reached = (counts <= 0);
+    stop_target_armed = !stop_target_reached;   // Armed last, so the interrupts never see half a target
 }
+
+void disarm_stop_target()
+{
+    stop_target_armed = 0;
+}
+//-------------------------------------------------------
+
+
+
+/*
+ADC scan engine.
+The ADC interrupt converts the channels of adc_channel_list one after the other, restarting the
+next conversion from the ISR, so every channel is sampled at the hardware conversion rate
+(14745600 / 64 / 13 = ~17.7k conversions per second, ~0.8 ms per sweep of 14 channels).
+Samples of a sweep are written into the back half of adc_sample; when the sweep is complete the
+halves are swapped and adc_sequence is incremented, so readers never wait for a conversion.
+
+Channel 0        - Battery voltage
+Channels 1 to 3  - White line sensors
+Channels 4 to 8  - IR proximity sensors 1 to 5
+Channels 9 to 13 - Sharp IR range sensors 1 to 5
+*/
 //------------------------------------------------------------------------------------
+#define ADC_CHANNELS 14
+#define ADC_NOT_SCANNED 0xFF
+
+const unsigned char adc_channel_list[ADC_CHANNELS] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13};
+unsigned char adc_slot[16];                             // Position of each ADC channel in adc_channel_list
+volatile unsigned char adc_sample[2][ADC_CHANNELS];     // Double buffered samples of the last complete sweep
+volatile unsigned char adc_front = 0;                   // Half of adc_sample holding the last complete sweep
+volatile unsigned char adc_sequence = 0;                // Incremented every time a sweep completes
+unsigned char adc_scan_index = 0;                       // Position in adc_channel_list being converted
+
+
+HAL_ISR(ADC)
+{
+    adc_sample[adc_front ^ 1][adc_scan_index] = hal_adc_result();
+
+    if(++adc_scan_index == ADC_CHANNELS)
+    {
+        adc_scan_index = 0;
+        adc_front ^= 1;
+        adc_sequence++;
+    }
+
+    hal_adc_select(adc_channel_list[adc_scan_index]);
+    hal_adc_start();            //Start the conversion of the next channel
+}
+
+
+void ADC_enable()
+{
+    // Function to enable the ADC and initialize the required registers
+
+    unsigned char i;
+
+    for(i = 0; i < 16; i++)
+        adc_slot[i] = ADC_NOT_SCANNED;
+    for(i = 0; i < ADC_CHANNELS; i++)
+        adc_slot[adc_channel_list[i]] = i;
+
+    adc_scan_index = 0;
+    hal_adc_select(adc_channel_list[0]);
+    hal_adc_init();
+    hal_adc_start();            // Start the first conversion of the scan
+}
 
 
-//Function to configure INT5 (PORTE 5) pin as input for the right position encoder
+/*
+Function to copy the last complete sweep into "dest" (ADC_CHANNELS bytes, in adc_channel_list order).
+The copy is retried if a sweep completed while it was being made, so all the samples belong to the same
+sweep. The sequence number of the copied sweep is returned.
+*/
+unsigned char adc_snapshot(unsigned char *dest)
+{
+    unsigned char i, sequence;
+
+    do
+    {
+        sequence = adc_sequence;
+        for(i = 0; i < ADC_CHANNELS; i++)
+            dest[i] = adc_sample[adc_front][i];
+    }
+    while(sequence != adc_sequence);
+
+    return sequence;
+}
 //------------------------------------------------------------------------------------
-void Right_Encoder_Pin_Configuration(void)
+
+/*
+Baud rates of UART0.
+14745600 Hz is an exact multiple of 16 times every rate below, so all of them have 0.0% error.
+UBRR0 = 14745600 / (16 * baud) - 1
+The X-Bee has to be set to the same rate (ATBD) before the bot is switched to it.
+*/
+#define BAUD_9600   0
+#define BAUD_19200  1
+#define BAUD_38400  2
+#define BAUD_57600  3
+#define BAUD_115200 4
+#define BAUD_230400 5
+#define BAUD_460800 6
+#define BAUD_921600 7
+#define BAUD_RATES  8
+
+#define UART0_DEFAULT_BAUD BAUD_9600
+
+const unsigned char uart0_ubrr[BAUD_RATES] = {95, 47, 23, 15, 7, 3, 1, 0};
+
+/* Function To Initialize UART0
+   baud rate: UART0_DEFAULT_BAUD  */
+
+void uart0_init(void)
 {
-    DDRE  = DDRE & 0xDF;  //Set the direction of the PORTE 4 pin as input
-    PORTE = PORTE | 0x20; //Enable internal pull-up for PORTE 4 pin
+    hal_uart_init(uart0_ubrr[UART0_DEFAULT_BAUD]);
 }
+
+
+/*
+Receive ring buffer of UART0.
+The receive interrupt only stores the byte and moves rx_head; the command dispatcher in main()
+is the only reader and moves rx_tail. Each index has a single writer and is one byte wide,
+so no locking is needed. RX_BUFFER_SIZE must be a power of two.
+*/
 //------------------------------------------------------------------------------------
+#define RX_BUFFER_SIZE 64
 
+volatile unsigned char rx_buffer[RX_BUFFER_SIZE];
+volatile unsigned char rx_head = 0;         // Next free slot, written by the ISR only
+volatile unsigned char rx_tail = 0;         // Next byte to read, written by the dispatcher only
+volatile unsigned char rx_overruns = 0;     // Bytes dropped because the buffer was full
 
-void Left_Wheel_Interrupt_Pin(void) //Interrupt 4 enable
+HAL_ISR(USART0_RX) 		// ISR for receive complete interrupt
 {
-    cli(); //Clears the global interrupt
-    EICRB = EICRB | 0x02; // INT4 is set to trigger with falling edge
-    EIMSK = EIMSK | 0x10; // Enable Interrupt INT4 for left position encoder
-    sei();   // Enables the global interrupt
+    unsigned char data = hal_uart_data();
+    unsigned char next = (rx_head + 1) & (RX_BUFFER_SIZE - 1);
+
+    if(next == rx_tail)
+    {
+        rx_overruns++;
+        return;
+    }
+    rx_buffer[rx_head] = data;
+    rx_head = next;
 }
 
 
-void Right_Wheel_Interrupt_Pin(void) //Interrupt 5 enable
+// Function to take the oldest received byte out of the buffer, returns 0 if it is empty
+unsigned char uart0_read(unsigned char *data)
 {
-    cli(); //Clears the global interrupt
-    EICRB = EICRB | 0x08; // INT5 is set to trigger with falling edge
-    EIMSK = EIMSK | 0x20; // Enable Interrupt INT5 for right position encoder
-    sei();   // Enables the global interrupt
+    unsigned char tail = rx_tail;
+
+    if(tail == rx_head)
+        return 0;
+
+    *data = rx_buffer[tail];
+    rx_tail = (tail + 1) & (RX_BUFFER_SIZE - 1);
+    return 1;
 }
 
-//Functions for incrementing the Shaft Encoder Values
-//--------------------------------------------------------
-ISR(INT4_vect)
+
+/*
+Transmit ring buffer of UART0.
+Writers only queue the byte and enable the data register empty interrupt, which then feeds the UART
+until the buffer is empty and disables itself again. TX_BUFFER_SIZE must be a power of two.
+*/
+#define TX_BUFFER_SIZE 128
+
+volatile unsigned char tx_buffer[TX_BUFFER_SIZE];
+volatile unsigned char tx_head = 0;         // Next free slot, written by the main context only
+volatile unsigned char tx_tail = 0;         // Next byte to send, written by the ISR only
+
+HAL_ISR(USART0_UDRE)
 {
-    Shaft_Counter_Left_Wheel ++;
+    unsigned char tail = tx_tail;
+
+    if(tail == tx_head)
+    {
+        hal_uart_tx_interrupt(0);           // Nothing left to send
+        return;
+    }
+    hal_uart_send(tx_buffer[tail]);
+    tx_tail = (tail + 1) & (TX_BUFFER_SIZE - 1);
 }
 
-ISR(INT5_vect)
+
+// Function to return the number of bytes that can be queued without waiting
+unsigned char uart0_tx_free()
 {
-    Shaft_Counter_Right_Wheel ++;
+    return (tx_tail - tx_head - 1) & (TX_BUFFER_SIZE - 1);
 }
-//-------------------------------------------------------
 
 
+// Function to queue one byte for sending, it only waits if the buffer is full
+void uart0_write(unsigned char data)
+{
+    unsigned char next = (tx_head + 1) & (TX_BUFFER_SIZE - 1);
 
-//Function to configure the motion pins and to enable the Motion ICs.
-//---------------------------------------------------------------------------
-void Motion_Configurations()
+    while(next == tx_tail);
+    tx_buffer[tx_head] = data;
+    tx_head = next;
+    hal_uart_tx_interrupt(1);
+}
+
+
+/*
+Binary frames sent over the X-Bee link:
+
+    0xA5 | length | type | sequence | payload (length bytes) | CRC high | CRC low
+
+The CRC is the CRC-16/XMODEM of everything from length to the end of the payload.
+Multi-byte payload fields are little endian.
+*/
+#define FRAME_START 0xA5
+#define FRAME_OVERHEAD 6
+#define FRAME_ACK       0x80
+#define FRAME_TELEMETRY 0x81
+#define FRAME_DONE      0x82
+#define FRAME_ABORTED   0x83
+#define FRAME_TASKS     0x84
+
+unsigned char frame_sequence = 0;
+unsigned int frame_crc;
+
+void frame_byte(unsigned char data)
 {
-    DDRA = 0x0F;
-    PORTA = 0x00;
-    DDRL = 0x18;
-    PORTL = 0x18;
+    frame_crc = hal_crc_xmodem(frame_crc, data);
+    uart0_write(data);
+}
 
+void frame_word(unsigned int data)
+{
+    frame_byte(data & 0xFF);
+    frame_byte(data >> 8);
 }
-//---------------------------------------------------------------------------
 
+void frame_begin(unsigned char type, unsigned char length)
+{
+    uart0_write(FRAME_START);
+    frame_crc = 0;
+    frame_byte(length);
+    frame_byte(type);
+    frame_byte(frame_sequence++);
+}
 
-void ADC_enable()
+void frame_end()
 {
-    // Function to enable the ADC and initialize the required registers
+    unsigned int crc = frame_crc;
 
-    DDRF = 0x00;
-    DDRK = 0x00;
-    ADCSRA = 0x86;
-    ADCSRB = 0x00;
-    ADMUX = 0x20;
-    ACSR = 0x80;
+    uart0_write(crc >> 8);
+    uart0_write(crc & 0xFF);
 }
 
-//Function to set up the LCD
-//-----------------------------------------
-void init_devices()
+
+/*
+Function to change the baud rate once everything queued has been sent.
+hal_uart_sent only tells that the last byte has left the shift register once a byte has been sent,
+so at least one byte (the acknowledgement) must have been queued before calling this.
+*/
+void uart0_set_baud(unsigned char rate)
 {
-    DDRC = 0xF7;
-    PORTC = 0x28;
+    while(tx_tail != tx_head);              // Wait for the queue to drain
+    while(!hal_uart_sent());
+    hal_uart_set_ubrr(uart0_ubrr[rate]);
 }
-//------------------------------------------
+//------------------------------------------------------------------------------------
 
-/* Function To Initialize UART0
-   desired baud rate:9600
-   actual baud rate:9600 (error 0.0%)
-   char size: 8 bit
-   parity: Disabled  */
 
-void uart0_init(void)
+// The scheduler tick, 1024 times a second (see hal_timer_init)
+HAL_ISR(TIMER2_COMPA)
 {
-    UCSR0B = 0x00; //disable while setting baud rate
-    UCSR0A = 0x00;
-    UCSR0C = 0x06;
-    UBRR0L = 0x5F; //set baud rate low
-    UBRR0H = 0x00; //set baud rate high
-    UCSR0B = 0x98;
+    sched_tick();
 }
 
 
@@ -140,18 +396,16 @@ void initialize()
 {
     // Function to call all the functions initializing the ports
 
-    Motion_Configurations();
+    motor_init();
     ADC_enable();
-    init_devices();
+    hal_lcd_init();
 
-    cli();       // Clears the global interrupts
+    hal_irq_disable();       // Clears the global interrupts
 
-    Left_Encoder_Pin_Configuration();
-    Right_Encoder_Pin_Configuration();
-    Right_Wheel_Interrupt_Pin();
-    Left_Wheel_Interrupt_Pin();
+    hal_encoder_init();
+    hal_timer_init();
 
-    sei();       // Enables the global interrupts
+    hal_irq_enable();        // Enables the global interrupts
 
 }
 
@@ -160,36 +414,113 @@ void init_xbee()
 {
     // Calling the function to initialize serial communication via XBee
 
-    cli();
+    hal_irq_disable();
     uart0_init(); //Initialize UART1 for serial communication
-    sei();
+    hal_irq_enable();
 }
 
 
-// Function to read the value from ADC and return it as an unsigned character
+// Function to return the latest sample of an ADC channel as an unsigned character
+// The value comes from the last sweep of the scan engine, so this never waits for a conversion
 //------------------------------------------------------------------------------------
 unsigned char Read_Sensor(unsigned char channel)
 {
+    unsigned char slot = adc_slot[channel & 0x0F];
+
+    if(slot == ADC_NOT_SCANNED)
+        return 0;
+
+    return adc_sample[adc_front][slot];
+}
+//------------------------------------------------------------------------------------
 
-    unsigned char reading;
 
-    if(channel>7) // The Appropriate Channel is the sensor from which the valur is to be taken
+/*
+Telemetry stream.
+telemetry_send queues one telemetry frame; it is run as a scheduler task at the telemetry rate.
+A frame is skipped rather than waited for if the transmit buffer is too full,
+so sending telemetry never holds up the control loops.
+
+Payload of FRAME_TELEMETRY (25 bytes):
+    x (mm), y (mm), theta (0.1 degree)               - signed 16 bit
+    left count, right count                          - signed 16 bit shaft encoder counters
+    Sharp sensor 1 to 5                              - raw 8 bit ADC samples
+    ADC sweep sequence                               - 8 bit
+    loop period, longest loop period since last frame - 16 bit TIMER1 counts (4.34 us) between sched_run calls
+    frames skipped                                   - 8 bit
+    wheel slips                                      - 8 bit count of slips seen by the odometry
+    receive overruns                                 - 8 bit count of bytes dropped with the receive buffer full
+    CRC errors                                       - 8 bit count of command frames dropped for a wrong CRC
+    paths given up                                   - 8 bit count of paths dropped by the avoidance (see avoid_give_up)
+*/
+//------------------------------------------------------------------------------------
+#define TELEMETRY_LENGTH 25
+
+unsigned char telemetry_skipped = 0;
+
+void telemetry_send()
+{
+    unsigned char sensor;
+    long x, y;
+    int theta;
+
+    if(uart0_tx_free() < TELEMETRY_LENGTH + FRAME_OVERHEAD)
     {
-        ADCSRB = 0x08;
+        telemetry_skipped++;
+        return;
     }
 
-    channel = channel & 0x07;
-    ADMUX= 0x20 | channel;
-    ADCSRA = ADCSRA | 0x40;     //Set start conversion bit
-
-    while((ADCSRA&0x10)==0);  //Wait for ADC conversion to complete
+    frame_begin(FRAME_TELEMETRY, TELEMETRY_LENGTH);
+    get_pose(&x, &y, &theta);
+    frame_word((x * 10) >> 8);
+    frame_word((y * 10) >> 8);
+    frame_word((long)theta * 3600 / HEADING_FULL);
+    frame_word(encoder_ticks(&left_encoder) - shaft_base_left);
+    frame_word(encoder_ticks(&right_encoder) - shaft_base_right);
+    for(sensor = 9; sensor <= 13; sensor++)
+        frame_byte(Read_Sensor(sensor));
+    frame_byte(adc_sequence);
+    frame_word(loop_period);
+    frame_word(loop_period_max);
+    frame_byte(telemetry_skipped);
+    frame_byte(odometry_slips);
+    frame_byte(rx_overruns);
+    frame_byte(command_crc_errors);
+    frame_byte(avoid_give_ups);
+    frame_end();
+
+    loop_period_max = 0;
+}
 
-    reading=ADCH;
-    ADCSRA = ADCSRA|0x10; //clear ADIF (ADC Interrupt Flag) by writing 1 to it
-    ADCSRB = 0x00;
 
-    return reading;
+/*
+Scheduler statistics, sent in answer to QUERY_TASKS (see sched_run).
+Payload of FRAME_TASKS (1 + 4 bytes per task):
+    number of tasks                                  - 8 bit
+    then for each task, in the order of sched_tasks:
+    late                                             - 8 bit count of releases missed
+    overruns                                         - 8 bit count of runs over the budget
+    worst                                            - 16 bit TIMER1 counts (4.34 us), longest run
+The counts and the longest run are cleared once sent, so each frame covers the time since the last one.
+*/
+void tasks_send()
+{
+    unsigned char i, interrupts;
 
+    frame_begin(FRAME_TASKS, 1 + 4 * sched_task_count);
+    frame_byte(sched_task_count);
+    for(i = 0; i < sched_task_count; i++)
+    {
+        interrupts = hal_irq_save();            // late is counted by the tick interrupt
+        frame_byte(sched_tasks[i].late);
+        sched_tasks[i].late = 0;
+        hal_irq_restore(interrupts);
+        frame_byte(sched_tasks[i].overruns);
+        frame_word(sched_tasks[i].worst);
+        sched_tasks[i].overruns = 0;
+        sched_tasks[i].worst = 0;
+    }
+    frame_end();
 }
 //------------------------------------------------------------------------------------
 
@@ -198,137 +529,366 @@ unsigned char Read_Sensor(unsigned char channel)
 //------------------------------------------------------------------------------------
 void forward_motion()
 {
-    PORTA = 0x06;
+    hal_motor_direction(0x06);
 }
 
 void backward_motion()
 {
-    PORTA = 0x09;
+    hal_motor_direction(0x09);
 }
 
 void left_motion()
 {
-    PORTA = 0x05;
+    hal_motor_direction(0x05);
 }
 
 void right_motion()
 {
-    PORTA = 0x0A;
+    hal_motor_direction(0x0A);
 }
 
 void stop_motion()
 {
-    PORTA = 0x00;
+    hal_motor_direction(0x00);
 }
 //-----------------------------------------------------------------------
 
 
-// Function to initialize the registers for motion control using PWM
+// Function to set the PWM duty of both motors, 0 .. MOTOR_DUTY_MAX (see motor.h)
 //-----------------------------------------------------------------------
 
-void velocity (unsigned char left_motor, unsigned char right_motor)
+void velocity (unsigned int left_motor, unsigned int right_motor)
 {
-    OCR5AL = (unsigned char)left_motor;
-    OCR5BL = (unsigned char)right_motor;
+    motor_duty(left_motor, right_motor);
 }
 //-----------------------------------------------------------------------
 
 
-// Return the angle turned by the bot
+/*
+Closed loop speed control of the wheels.
+While speed_control is set, the speed task reads the speed of each wheel from its encoder timestamps every
+SPEED_PERIOD ticks and sets the PWM duty through velocity() so that both wheels run at the commanded speed.
+The gains below are starting values for the Firebird V motors and are tuned per wheel.
+cruise_speed - Speed in cm/s used when moving along a calculated line (the path follower and the returns
+               of key 7 and 9); SET_SPEED sets it to the mean of the two wheel speeds it commands.
+
+Motions that arm a stop target call start_profile; until the target is reached the speed task scales the
+commanded speeds with a trapezoidal profile (see profile.h), accelerating at PROFILE_ACCEL from
+PROFILE_CREEP and braking in time to arrive at PROFILE_CREEP. The wheels neither slip on the start
+nor coast past the target, so the bot can cruise faster without losing the dead reckoning.
+*/
 //-----------------------------------------------------------------------
-double get_angle()
-{
+#define SPEED_PERIOD 32         // 32 updates per second
+#define SPEED_KFF    1180       // ~4.6 duty per count/s
+#define SPEED_KP     512        // 2.0 duty per count/s of error
+#define SPEED_KI     64         // 0.25 duty per count/s of error per update
 
-    /*************************
-    88 pulses for 360 degrees ==> 4.090 degrees per count
-    The angle rotated is calculated by measuring the number of counts
-    and multiplying it by 4.090 which is the resolution to get the degrees
-    *************************/
+#define PROFILE_ACCEL 60        // cm/s^2
+#define PROFILE_CREEP 5         // cm/s
 
-    double angle = 4.090*(Shaft_Counter_Right_Wheel + Shaft_Counter_Left_Wheel)/2;
-    return angle;
-}
-//-----------------------------------------------------------------------
+wheel_speed left_speed = {SPEED_KFF, SPEED_KP, SPEED_KI};
+wheel_speed right_speed = {SPEED_KFF, SPEED_KP, SPEED_KI};
+unsigned char speed_control = 0;
+int cruise_speed = 45;
 
+int left_command = 0, right_command = 0;        // Commanded speeds, counts per second
+speed_profile motion_profile;
+unsigned char profile_active = 0;
+
+// Function to command the wheel speeds in cm/s and hand the PWM over to the speed controllers
+void set_speed(int left_cms, int right_cms)
+{
+    left_command = cms_to_counts(left_cms);
+    right_command = cms_to_counts(right_cms);
+    left_speed.target = left_command;
+    right_speed.target = right_command;
+    speed_control = 1;
+}
 
 /*
-Function to rotate bot to the left by a specified angle.
-The angle rotated is measured using data from the shaft encoders.
-A node is formed at which the bot rotates.
-This node is then used to calculate any further motions.
+Function to hand the wheels back to the speed controllers, at cruise_speed, if SET_VELOCITY has taken
+them over. Every motion that waits for a stop target or steers calls it first: with the raw duty of
+SET_VELOCITY (possibly 0) the target might never be reached.
 */
-//-----------------------------------------------------------------------
-void Left_Rotation_Degrees(int Degrees)
+void speed_resume()
 {
+    if(!speed_control)
+        set_speed(cruise_speed, cruise_speed);
+}
 
+// Function to set the wheel targets to the commanded speeds scaled to the profile speed
+void profile_targets(int speed)
+{
+    left_speed.target = (long)left_command * speed / motion_profile.cruise;
+    right_speed.target = (long)right_command * speed / motion_profile.cruise;
+}
 
-    init_x = current_x;
-    init_y = current_y;
+// Function to ramp the commanded speeds over the motion up to the armed stop target
+void start_profile()
+{
+    int cruise = (left_command > right_command) ? left_command : right_command;
 
-    left_motion(); //Turn left
+    if(!speed_control || cruise <= 0)
+        return;
 
-    float Reqd_Shaft_Counter = (float) Degrees/ 4.090;                // division by resolution to get shaft count
-    Reqd_Shaft_Counter = (unsigned int) Reqd_Shaft_Counter;
-    Shaft_Counter_Left_Wheel = 0;
-    Shaft_Counter_Right_Wheel = 0;
-    double initial_theta = current_theta;
+    profile_start(&motion_profile, cruise, cms_to_counts(PROFILE_CREEP), cms_to_counts(PROFILE_ACCEL), SCHED_TICK_HZ / SPEED_PERIOD);
+    profile_targets(motion_profile.speed);
+    profile_active = 1;
+}
 
-    while (1)
+void speed_task()
+{
+    int remaining;
+
+    if(!speed_control)
+        return;
+
+    if(profile_active)
     {
-        current_theta = initial_theta - get_angle();
-        if(current_theta<0)
+        if(stop_target_armed)
         {
-            lcd_cursor(1,2);
-            lcd_string("-");
-            lcd_print(1,3,(-1 * current_theta),4);
+            remaining = (int)(stop_target - encoder_ticks(&left_encoder) - encoder_ticks(&right_encoder)) / 2;
+            profile_targets(profile_next(&motion_profile, remaining));
         }
         else
         {
-            lcd_cursor(1,2);
-            lcd_string("+");
-            lcd_print(1,3,current_theta,4);
+            profile_active = 0;                 // Target reached or given up, back to the commanded speeds
+            left_speed.target = left_command;
+            right_speed.target = right_command;
         }
-        if((Shaft_Counter_Right_Wheel+Shaft_Counter_Left_Wheel)/2 >= Reqd_Shaft_Counter)
-            break;
     }
-    stop_motion();
+    odometry_set_steer(left_speed.target, right_speed.target);
+
+    if(hal_motor_direction_read() == 0)     // Motors stopped: keep the integrators from winding up
+    {
+        speed_reset(&left_speed);
+        speed_reset(&right_speed);
+        return;
+    }
+
+    velocity(speed_update(&left_speed, encoder_speed(&left_encoder)),
+             speed_update(&right_speed, encoder_speed(&right_encoder)));
 }
+//-----------------------------------------------------------------------
 
 
+/*
+Odometry.
+odometry_update runs from the TIMER4 interrupt 256 times a second. It takes the ticks counted by each
+encoder since the previous update, signs them with the direction that wheel is driven in on PORTA
+(PA1/PA0 left forward/back, PA2/PA3 right forward/back) and moves the pose as a differential drive:
+
+    distance = (left + right) / 2 counts      0.27 cm per count
+    turn     = (left - right) counts          HEADING_PER_COUNT / 2 heading units per count
+
+Half of the 15.2 cm wheel base turns 176 counts of both wheels into a full turn, which gives the
+HEADING_PER_COUNT / 2 above. The position is moved along the mean heading of the update, so arcs
+and uneven wheels on a "straight" line are followed as well as straight runs and turns in place.
+After stop_motion the wheels coast for a few counts; those keep the direction of the last motion
+of their wheel, so no tick is lost and the pose never depends on when, or whether, the motion
+functions reset their shaft counters.
+
+The sum of the ticks is multiplied by 1106 / 32 for 1/256 cm, and the remainder of the division is
+carried to the next update.
+
+Slip detection: the counts of the wheels should keep the ratio of the speeds they are driven at.
+speed_task publishes that ratio as odometry_steer, (left - right) / (left + right) of the target
+speeds in Q7, one byte so the interrupt never reads half of it; the path follower steers with unequal
+speeds, the other motions have it 0. The difference of the unsigned counts less the share of it the
+ratio asks for is summed (Q7) from the start of each motion; when it goes over ODOMETRY_SLIP_COUNTS one
+wheel has spun (or stalled) and the heading can no longer be trusted, so odometry_slips is incremented.
+With the speeds open loop (SET_VELOCITY, speed_control clear) the ratio is not known and nothing is checked.
+*/
+//-----------------------------------------------------------------------
+#define ODOMETRY_SLIP_COUNTS 8          // 2.2 cm, 16 degrees of heading
+
+unsigned int odometry_left_ticks = 0, odometry_right_ticks = 0;
+signed char odometry_left_sign = 1, odometry_right_sign = 1;
+unsigned char odometry_direction = 0x00;
+unsigned char odometry_remainder = 0;
+int odometry_slip_balance = 0;                      // Q7 counts
+volatile unsigned char odometry_slips = 0;
+volatile signed char odometry_steer = 0;            // Q7, written by speed_task
+
+// Function to publish the ratio of the target speeds (counts/s) of the wheels for the slip detection
+void odometry_set_steer(int left, int right)
+{
+    long sum, steer;
+
+    if(left < 0)
+        left = -left;
+    if(right < 0)
+        right = -right;
+    sum = (long)left + right;
+    steer = sum ? ((long)(left - right) << 7) / sum : 0;
+    odometry_steer = (steer > 127) ? 127 : steer;
+}
 
-void Right_Rotation_Degrees(int Degrees)
+void odometry_update()
 {
-    init_x = current_x;
-    init_y = current_y;
+    unsigned int left_ticks = left_encoder.ticks, right_ticks = right_encoder.ticks;  // Interrupts do not nest, no snapshot needed
+    int left = left_ticks - odometry_left_ticks;
+    int right = right_ticks - odometry_right_ticks;
+    unsigned char direction = hal_motor_direction_read();
+    int turn, mid;
+    long distance;
 
-    right_motion(); //Turn right
+    odometry_left_ticks = left_ticks;
+    odometry_right_ticks = right_ticks;
 
-    float Reqd_Shaft_Counter = (float) Degrees/ 4.090; // division by resolution to get shaft count
-    Reqd_Shaft_Counter = (unsigned int) Reqd_Shaft_Counter;
-    Shaft_Counter_Left_Wheel = 0;
-    Shaft_Counter_Right_Wheel = 0;
-    double initial_theta = current_theta;
+    if(direction && direction != odometry_direction)   // A new motion: take the wheel directions
+    {
+        odometry_direction = direction;
+        if(direction & 0x02)
+            odometry_left_sign = 1;
+        else if(direction & 0x01)
+            odometry_left_sign = -1;
+        if(direction & 0x04)
+            odometry_right_sign = 1;
+        else if(direction & 0x08)
+            odometry_right_sign = -1;
+        odometry_slip_balance = 0;
+    }
+    if(left == 0 && right == 0)
+        return;
 
-    while (1)
+    if(speed_control)
     {
-        current_theta = initial_theta + get_angle();
-        if(current_theta<0)
+        odometry_slip_balance += ((left - right) << 7) - (left + right) * odometry_steer;
+        if(odometry_slip_balance > (ODOMETRY_SLIP_COUNTS << 7) || odometry_slip_balance < -(ODOMETRY_SLIP_COUNTS << 7))
         {
-            lcd_cursor(1,2);
-            lcd_string("-");
-            lcd_print(1,3,(-1 * current_theta),4);
+            if(odometry_slips != 0xFF)
+                odometry_slips++;
+            odometry_slip_balance = 0;
         }
-        else
-        {
-            lcd_cursor(1,2);
-            lcd_string("+");
-            lcd_print(1,3,current_theta,4);
-        }
-        if((Shaft_Counter_Right_Wheel+Shaft_Counter_Left_Wheel)/2 >= Reqd_Shaft_Counter)
-            break;
     }
-    stop_motion();
 
+    left *= odometry_left_sign;
+    right *= odometry_right_sign;
+
+    turn = (left - right) * (HEADING_PER_COUNT / 2);
+    mid = current_theta + turn / 2;
+
+    distance = (long)(left + right) * DIST_Q12_PER_COUNT + odometry_remainder;
+    odometry_remainder = distance & 0x1F;
+    distance >>= 5;                                     // Rounds down, the remainder stays positive
+
+    seq_write(&pose_sequence);
+    if(distance)
+    {
+        current_x += scale_q14(distance, heading_sin(mid));
+        current_y += scale_q14(distance, heading_cos(mid));
+    }
+    current_theta = heading_normalize(current_theta + turn);
+    seq_write(&pose_sequence);
+}
+
+HAL_ISR(TIMER4_COMPA)
+{
+    odometry_update();
+    encoder_check(&left_encoder);
+    encoder_check(&right_encoder);
+}
+
+
+// Function to take a consistent copy of the pose without holding up the odometry interrupt
+void get_pose(long *x, long *y, int *theta)
+{
+    unsigned char start;
+
+    do
+    {
+        start = seq_read_begin(&pose_sequence);
+        *x = current_x;
+        *y = current_y;
+        *theta = current_theta;
+    } while(seq_read_retry(&pose_sequence, start));
+}
+
+int get_heading()
+{
+    long x, y;
+    int theta;
+
+    get_pose(&x, &y, &theta);
+    return theta;
+}
+
+// Function to form a node at the current position and leave it on the trail
+void set_node()
+{
+    long x, y;
+    int theta;
+
+    get_pose(&x, &y, &theta);
+    trail_add(x, y);
+}
+//-----------------------------------------------------------------------
+
+
+/*
+motion_mode - The motion the functions below are carrying out; the obstacle task only checks
+              the Sharp sensor while moving forward.
+*/
+//-----------------------------------------------------------------------
+#define MOTION_IDLE    0
+#define MOTION_FORWARD 1
+#define MOTION_LEFT    2
+#define MOTION_RIGHT   3
+#define MOTION_FOLLOW  4
+
+unsigned char motion_mode = MOTION_IDLE;
+//-----------------------------------------------------------------------
+
+
+/*
+Function to rotate bot to the left by a specified angle (in heading units).
+The angle rotated is measured using data from the shaft encoders.
+A node is formed at which the bot rotates and left on the trail (see trail.h).
+The start_ functions only start the motion, which the encoder interrupts stop at the target;
+wait_motion waits for it, so the state machines can start a motion and check on it later.
+*/
+//-----------------------------------------------------------------------
+void start_left_rotation(int Heading)
+{
+    set_node();
+
+    int Reqd_Shaft_Counter = (Heading + HEADING_PER_COUNT / 2) / HEADING_PER_COUNT;   // division by resolution to get shaft count
+    reset_shaft_counters();
+    arm_stop_target(2 * Reqd_Shaft_Counter);
+    if(stop_target_reached)
+        return;
+    speed_resume();
+    start_profile();
+    motion_mode = MOTION_LEFT;
+
+    left_motion(); //Turn left
+}
+
+void start_right_rotation(int Heading)
+{
+    set_node();
+
+    int Reqd_Shaft_Counter = (Heading + HEADING_PER_COUNT / 2) / HEADING_PER_COUNT;   // division by resolution to get shaft count
+    reset_shaft_counters();
+    arm_stop_target(2 * Reqd_Shaft_Counter);
+    if(stop_target_reached)
+        return;
+    speed_resume();
+    start_profile();
+    motion_mode = MOTION_RIGHT;
+
+    right_motion(); //Turn right
+}
+
+// Function to wait until the motion started last has reached its stop target
+void wait_motion()
+{
+    while(!stop_target_reached)
+        sched_yield();          // current_theta is kept up to date by the odometry interrupt
+
+    stop_motion();
+    motion_mode = MOTION_IDLE;
 }
 //-----------------------------------------------------------------------
 
@@ -336,362 +896,871 @@ void Right_Rotation_Degrees(int Degrees)
 //-----------------------------------------------------------------------
 unsigned int convert(unsigned char reading)
 {
-    // Function to convert the character reading from the ADC to the calibrated integer value
+    // The front Sharp sensor (ADC channel 11) is sensor 3; the conversion is a single flash table read
 
-    int dist;
-    dist = (int)(10.00*(2799.6*(1.00/(pow(reading,1.1546)))));
-    return dist;
+    return sharp_distance(3, reading);
 
 }
 //-----------------------------------------------------------------------
 
+
+
 /*
-Function to calculate coordinates of the bot and changing coordinates to Cartesian system from polar coordinates
-change in coordinates from the previous node (init_x & init_y) is calculated
-using the distance travelled(r) and current angle(current_theta)
-The Global variables current_x and current_y are then updated.
+Scheduler tasks that follow the motion.
+field_task    - reads the five Sharp sensors and the five IR proximity sensors from one ADC sweep (adc_snapshot),
+                so all of them are taken at the same time, and rebuilds the obstacle field (see field.h). The IR proximity readings fall as an obstacle comes closer;
+                below IR_NEAR_READING something is within FIELD_IR_RANGE.
+grid_task     - enters the range of one Sharp sensor per run into the occupancy grid (see grid.h), seen from
+                the current pose, so each sensor is entered every 5 runs.
+obstacle_task - while moving forward, compares the free distance straight ahead with reference_distance and
+                raises obstacle_detected for the path follower and the avoidance.
+display_task  - writes current_theta, current_x and current_y into the LCD framebuffer.
+                The LCD cannot print negative nos. so the sign is written in front of the digits.
 */
 //-----------------------------------------------------------------------
-void coordinate_calculation(double r)
+unsigned char obstacle_detected = 0;
+unsigned int obstacle_distance = 0;
+
+#define AVOID_IDLE       0
+#define AVOID_LOOK       1
+#define AVOID_TURN       2
+#define AVOID_TURN_ROUND 3
+#define AVOID_SIDESTEP   4
+
+unsigned char avoid_state = AVOID_IDLE;
+unsigned char avoid_attempts = 0;               // Avoidances since the last progress, see avoid_begin
+
+#define IR_NEAR_READING 100
+
+unsigned int field_range[FIELD_SENSORS];        // mm, FIELD_NO_RANGE when nothing is seen
+
+void field_task()
 {
+    unsigned char sensor;
+    unsigned char sweep[ADC_CHANNELS];
 
-    current_x =  init_x + r*sin(current_theta*pi/180.0);
-    current_y =  init_y + r*cos(current_theta*pi/180.0);
+    adc_snapshot(sweep);
+    for(sensor = 0; sensor < SHARP_SENSORS; sensor++)
+        field_range[sensor] = sharp_distance(sensor + 1, sweep[adc_slot[9 + sensor]]);
+    for(sensor = 0; sensor < 5; sensor++)
+        field_range[SHARP_SENSORS + sensor] = (sweep[adc_slot[4 + sensor]] < IR_NEAR_READING) ? FIELD_IR_RANGE : FIELD_NO_RANGE;
 
+    field_build(field_range);
+}
 
-    /*
-    There are separate conditions for positive and negative coordinates as LCD cannot directly print negative nos.
-    */
+unsigned char grid_sensor = 0;
+
+void grid_task()
+{
+    long x, y;
+    int theta;
+
+    get_pose(&x, &y, &theta);
+    grid_update(x, y, theta, field_range[grid_sensor], field_sensor_angle[grid_sensor]);
 
-    if(current_x >= 0)
+    if(++grid_sensor == SHARP_SENSORS)
+        grid_sensor = 0;
+}
+
+void obstacle_task()
+{
+    unsigned int distance;
+
+    if(motion_mode != MOTION_FORWARD && motion_mode != MOTION_FOLLOW)
+        return;
+
+    distance = field_free[FIELD_CENTER];
+    if(distance < reference_distance)
     {
-        lcd_cursor(1,13);											 //Printing the x-coordinate on the LCD
-        lcd_string("+");
-        lcd_print(1,13,current_x,4);
+        obstacle_distance = distance;
+        obstacle_detected = 1;
     }
-    if(current_x < 0)
+}
+
+void display_signed(char row, char column, int value)
+{
+    lcd_cursor(row, column);
+    if(value < 0)
     {
-        lcd_cursor(1,13);
         lcd_string("-");
-        lcd_print(1,13,(-1 * current_x),4);
+        value = -value;
     }
-    if(current_y >= 0)												 //Printing the y-coordinate on the LCD
-    {
-        lcd_cursor(2,13);
+    else
         lcd_string("+");
-        lcd_print(2,13,current_y,4);
-    }
-    if(current_y < 0)
-    {
-        lcd_cursor(2,13);
-        lcd_string("-");
-        lcd_print(2,13,(-1 * current_y),4);
-    }
+    lcd_print(row, column + 1, value, 4);
+}
 
+void display_task()
+{
+    long x, y;
+    int theta;
+
+    get_pose(&x, &y, &theta);
+    display_signed(1, 2, HEADING_TO_DEG(theta));
+    display_signed(1, 12, Q8_TO_CM(x));
+    display_signed(2, 12, Q8_TO_CM(y));
 }
 //-----------------------------------------------------------------------
 
 
 
+
 /*
-Function to return the distance travelled by the bot from the previous node
-Distance is calculated by measuring the counts of the shaft encoder
+Function to start moving forward "dist" cm, the obstacle task watches the way meanwhile.
+A wheel moves 0.27 cm per count (88 pulses for 47.8 cm, both edges of a pulse counted) and the bot the mean
+of the two, so "dist" is dist * 2 / 0.27 counts of both shaft counters together: 1/256 cm * 32 / 1106.
+The stop target is the first count past it.
 */
-//-----------------------------------------------------------------------
-double get_dist()
+void start_forward(unsigned int dist)
 {
-    /*********************************************
+    reset_shaft_counters();
+    arm_stop_target(((long)CM_TO_Q8(dist) << 5) / DIST_Q12_PER_COUNT + 1);
+    speed_resume();
+    start_profile();
+
+    obstacle_detected = 0;
+    motion_mode = MOTION_FORWARD;
+    forward_motion();
+}
 
-    Radius of circle along which bot moves = 7.6cm
-      88 pulses for 360 degree rotation  =>  88 pulses for 2*pi*7.6 = 47.8 cm
-    Thus, 0.54 cm per count
+//Function to rotate to a specific angle
+//-----------------------------------------------------------------------
+void start_rotate_to(int angle)                         // Start rotating the bot in place until it faces "angle" (heading units)
+{
+    int turn = heading_normalize(angle - get_heading());   // Always turn the short way round
 
-    *********************************************/
+    if(turn>0)                                          //if rotation angle is positive it starts right rotation.
+        start_right_rotation(turn);                     //aligns the bot such that it face towards the final point.
 
-    double distance_travelled_till_yet = 0.54*(Shaft_Counter_Left_Wheel+Shaft_Counter_Right_Wheel)/2;
+    else if(turn<0)                                     //if rotation angle is negative it starts left rotation.
+        start_left_rotation(-turn);                     //aligns the bot such that it face towards the final point.
 
-    // Also update coordinates of the bot
-    coordinate_calculation(distance_travelled_till_yet);
+    else
+        arm_stop_target(0);                             //already there, nothing to wait for
+}
 
-    return distance_travelled_till_yet;
+void rotate_to(int angle)
+{
+    start_rotate_to(angle);
+    wait_motion();
 }
 //-----------------------------------------------------------------------
 
 
-
-
 /*
-Function to keep track of the distance traveled by the bot from the starting point
-and also continuously keep checking for obstacles.
-If obstacles are detected the BCAS is activated.
-Also the distance travelled from the previous node is returned continuously to check
-if the required distance has been transversed yet or net.
+Path following.
+Instead of stopping and turning in place at every point, the bot follows a path of up to PATH_POINTS
+points while it keeps driving, steering with the difference of the wheel speeds (pure pursuit).
+follow_task runs before the speed task at the same rate. It projects the pose on the segment being
+followed, takes the point FOLLOW_LOOKAHEAD further along the segment and sets the wheel speeds for the
+arc that passes through it:
+
+    alpha          - angle from the heading of the bot to the lookahead point, at distance d
+    curvature      - 2 sin(alpha) / d
+    left, right    - speed * (1 +- curvature * half wheel base)
+
+The heading is corrected all the time from the odometry, so a drift or a push is steered out while
+moving. When the lookahead point reaches the end of a segment and another point follows, the follower
+moves on to the next segment, which rounds the corner instead of stopping at it; the corner is left on
+the trail (see trail.h), so a retrace comes back round it instead of cutting across. The speed is ramped
+by the speed profile and brakes only for the last point, where the bot stops.
+The bot only turns in place first (follow_pivoting) when the path starts more than FOLLOW_PIVOT away
+from its heading.
+
+Points added for a MOVE_TO command keep the frame sequence and are answered with FRAME_DONE when the
+bot reaches or rounds them, or with FRAME_ABORTED when the path is dropped before (see path_drop). If an obstacle comes up the follower stops and hands over to the obstacle
+avoidance, which starts the follower again on the rest of the path once it is past the obstacle.
 */
 //-----------------------------------------------------------------------
-void check_dist_travelled(unsigned int dist)
+#define PATH_POINTS        8
+#define PATH_NO_SEQUENCE   0xFFFF
+#define FOLLOW_LOOKAHEAD   CM_TO_Q8(20)
+#define FOLLOW_TOLERANCE   CM_TO_Q8(1)
+#define FOLLOW_PIVOT       DEG_TO_HEADING(45)
+#define FOLLOW_HALF_BASE   1946                 // 7.6 cm in 1/256 cm
+
+long path_x[PATH_POINTS], path_y[PATH_POINTS];  // 1/256 cm
+unsigned int path_sequence[PATH_POINTS];        // Sequence of the MOVE_TO frame, or PATH_NO_SEQUENCE
+unsigned char path_head = 0, path_count = 0;
+long segment_x = 0, segment_y = 0;              // Start of the segment being followed
+unsigned char follow_pivoting = 0;
+
+// Function to drop the point at the head of the path, it becomes the start of the next segment
+void path_pop()
+{
+    if(path_sequence[path_head] != PATH_NO_SEQUENCE)
+        move_done(path_sequence[path_head]);
+    segment_x = path_x[path_head];
+    segment_y = path_y[path_head];
+    path_head = (path_head + 1) % PATH_POINTS;
+    path_count--;
+    avoid_attempts = 0;                         // A point reached is progress
+}
+
+// Function to drop the whole path; the MOVE_TO points not reached are answered with FRAME_ABORTED, not FRAME_DONE
+void path_drop()
+{
+    while(path_count)
+    {
+        if(path_sequence[path_head] != PATH_NO_SEQUENCE)
+            move_aborted(path_sequence[path_head]);
+        path_head = (path_head + 1) % PATH_POINTS;
+        path_count--;
+    }
+    avoid_attempts = 0;
+}
+
+// Function to stop following and give the wheels their commanded speeds back, the path is kept
+void follow_halt()
+{
+    stop_motion();
+    motion_mode = MOTION_IDLE;
+    left_speed.target = left_command;
+    right_speed.target = right_command;
+}
+
+// Function to start driving along the path from the current position
+void follow_drive()
+{
+    int theta;
+
+    get_pose(&segment_x, &segment_y, &theta);
+    speed_resume();
+    obstacle_detected = 0;
+    follow_pivoting = 0;
+    profile_active = 0;                         // The follower sets the wheel speeds itself
+    profile_start(&motion_profile, cms_to_counts(cruise_speed), cms_to_counts(PROFILE_CREEP), cms_to_counts(PROFILE_ACCEL), SCHED_TICK_HZ / SPEED_PERIOD);
+    left_speed.target = motion_profile.speed;
+    right_speed.target = motion_profile.speed;
+    forward_motion();
+    motion_mode = MOTION_FOLLOW;
+}
+
+// Function to start following from the current position, turning in place first if the path starts behind
+void follow_start()
+{
+    long x, y, dist;
+    int theta, turn;
+
+    get_pose(&x, &y, &theta);
+    turn = heading_normalize(heading_atan2(path_x[path_head] - x, path_y[path_head] - y, &dist) - theta);
+    if(turn > FOLLOW_PIVOT || turn < -FOLLOW_PIVOT)
+    {
+        start_rotate_to(theta + turn);
+        follow_pivoting = 1;
+        motion_mode = MOTION_FOLLOW;            // follow_task drives on when the turn is finished
+    }
+    else
+        follow_drive();
+}
+
+// Function to append a point (1/256 cm) to the path and start following if needed, returns 0 if the path is full
+unsigned char path_add(long x, long y, unsigned int sequence)
+{
+    unsigned char i;
+
+    if(path_count == PATH_POINTS)
+        return 0;
+
+    i = (path_head + path_count) % PATH_POINTS;
+    path_x[i] = x;
+    path_y[i] = y;
+    path_sequence[i] = sequence;
+    path_count++;
+
+    if(motion_mode != MOTION_FOLLOW && avoid_state == AVOID_IDLE)
+        follow_start();
+    return 1;
+}
+
+// Function to stop following, or avoiding an obstacle, and drop the whole path
+void follow_stop()
 {
-    Shaft_Counter_Left_Wheel = 0;
+    if(motion_mode == MOTION_FOLLOW)
+    {
+        disarm_stop_target();
+        follow_halt();
+    }
+    if(avoid_state != AVOID_IDLE)
+    {
+        disarm_stop_target();
+        stop_motion();
+        motion_mode = MOTION_IDLE;
+        avoid_state = AVOID_IDLE;
+    }
+    follow_pivoting = 0;
+    path_drop();
+}
 
-    Shaft_Counter_Right_Wheel = 0;
+void follow_task()
+{
+    long x, y, seg_len, along, rest, look_x, look_y, dist, ratio, counts;
+    int theta, seg_heading, alpha, speed;
 
-    /* Distance from the obstacle is measured using the Sharp Sensor and the value converted to an integer.
-       If this value is less than the set reference distance, BCAS is activated.
-       */
+    if(motion_mode != MOTION_FOLLOW)
+        return;
 
-    while (1)
+    if(follow_pivoting)
     {
-        unsigned char reading=Read_Sensor(11);
-        double distance =convert(reading);
-        if (distance<reference_distance)
+        if(stop_target_reached)
+            follow_drive();
+        return;
+    }
+
+    if(obstacle_detected)
+    {
+        follow_halt();
+        avoid_begin();
+        return;
+    }
+
+    get_pose(&x, &y, &theta);
+    while(1)
+    {
+        seg_heading = heading_atan2(path_x[path_head] - segment_x, path_y[path_head] - segment_y, &seg_len);
+        along = scale_q14(x - segment_x, heading_sin(seg_heading)) + scale_q14(y - segment_y, heading_cos(seg_heading));
+        rest = seg_len - along;
+        if(path_count > 1 && rest < FOLLOW_LOOKAHEAD)
         {
-            avoiding_obstacle(distance);
+            trail_add(path_x[path_head], path_y[path_head]);   // The corner is left on the trail, so the way back rounds it too
+            path_pop();                         // Round the corner onto the next segment
         }
-
-        if (get_dist()>dist)
+        else
             break;
+    }
 
+    if(path_count == 1 && rest <= FOLLOW_TOLERANCE)
+    {
+        follow_halt();
+        set_node();
+        path_pop();
+        return;
     }
 
-    stop_motion();
+    along += FOLLOW_LOOKAHEAD;
+    if(along > seg_len)
+        along = seg_len;
+    look_x = segment_x + scale_q14(along, heading_sin(seg_heading));
+    look_y = segment_y + scale_q14(along, heading_cos(seg_heading));
+    alpha = heading_normalize(heading_atan2(look_x - x, look_y - y, &dist) - theta);
+
+    counts = (path_count > 1) ? 0x7FFF : rest * 16 / DIST_Q12_PER_COUNT;     // Counts of each wheel to the last point
+    if(counts > 0x7FFF)
+        counts = 0x7FFF;
+    speed = profile_next(&motion_profile, counts);
+
+    if(alpha >= HEADING_QUARTER)                // Lookahead point behind: turn as tightly as possible
+        ratio = SINE_ONE;
+    else if(alpha <= -HEADING_QUARTER)
+        ratio = -SINE_ONE;
+    else
+    {
+        ratio = (long)heading_sin(alpha) * (2 * FOLLOW_HALF_BASE) / ((dist > 0) ? dist : 1);
+        if(ratio > SINE_ONE)
+            ratio = SINE_ONE;
+        else if(ratio < -SINE_ONE)
+            ratio = -SINE_ONE;
+    }
+
+    left_speed.target = speed + (((long)speed * ratio) >> 14);
+    right_speed.target = speed - (((long)speed * ratio) >> 14);
+}
+
+// Function to wait until the path is finished, including any obstacle avoided on the way
+void follow_wait()
+{
+    while(motion_mode == MOTION_FOLLOW || avoid_state != AVOID_IDLE)
+        sched_yield();
 }
 //-----------------------------------------------------------------------
 
 
-//Function to move forward a certain distance
+/*
+Obstacle avoidance (BCAS).
+When the follower or a straight run finds an obstacle closer than reference_distance, avoid_begin stops
+the bot and avoid_task takes over. It is a state machine run by the scheduler, so avoiding does not
+nest motions in one another: any number of obstacles, one behind the other, take the same memory.
+
+AVOID_LOOK       - once the sensors have had time for fresh readings, the obstacle field gives the clear
+                   direction closest to the route in one go (see field_pick)
+AVOID_TURN       - the bot turns in place to that direction
+AVOID_SIDESTEP   - the bot moves forward to get clear of the obstacle; an obstacle found meanwhile
+                   starts a new look from there
+AVOID_TURN_ROUND - no direction in front is clear: the bot turns round and looks again, once
+Once clear, the follower starts again from the new position on what is left of the path, so the route
+goes on to the points it was heading for. If the way behind is blocked as well the bot stops and drops
+the path.
+
+To minimize the returning path of the bot it was necessary that bot clears the obstacle proportional to the
+size of the obstacle. The sidestep is 10 cm / cos(angle between the clear direction and the route), thus
+clearing the obstacle and also reducing the path length at the same time. It is never longer than
+AVOID_SIDESTEP_MAX, nor than the free distance of the picked direction less AVOID_CLEARANCE, so a turn
+almost across the route (along a wall) does not send the bot off for a metre or more.
+
+Giving up: a bot with a wrong pose (a wheel spinning against a corner the sensors do not see, a heading
+gone off) can look for a point behind a wall and avoid it for ever. Every avoidance counts an attempt;
+the count starts again when the bot reaches a point of the path, or has come AVOID_PROGRESS closer to
+the one it heads for (by the odometry) than at the first attempt counted. After AVOID_ATTEMPTS attempts
+without progress, or when boxed in, avoid_give_up stops the bot and drops the path, which answers the
+MOVE_TO points on it with FRAME_ABORTED; avoid_give_ups counts it for the telemetry, and avoid_gave_up
+tells the return of key 7 or 9 that it has not reached home.
+*/
 //-----------------------------------------------------------------------
-void move_forward(unsigned int dist)
+#define AVOID_SETTLE     MS_TO_TICKS(50)        // The Sharp sensors update every 38 ms
+#define AVOID_CLEARANCE  30                     // mm
+#define AVOID_CLEAR_AWAY 400                    // mm the bot must be able to drive in the direction it picks
+#define AVOID_SIDESTEP_MAX 30                   // cm
+#define AVOID_ATTEMPTS   6                      // Avoidances allowed without progress
+#define AVOID_PROGRESS   CM_TO_Q8(20)
+
+unsigned char avoid_turned_round = 0;
+unsigned int avoid_stamp = 0;
+int avoid_turn = 0;                             // Angle between the picked direction and the route
+unsigned int avoid_free = 0;                    // mm free in the picked direction
+long avoid_best = 0;                            // Distance to the point headed for at the first attempt counted, 1/256 cm
+unsigned char avoid_gave_up = 0;                // Set by avoid_give_up, cleared by the returns of key 7 and 9
+unsigned char avoid_give_ups = 0;               // Paths dropped by avoid_give_up
+
+// Function to stop avoiding and drop the path, the bot is not getting anywhere
+void avoid_give_up()
 {
-    forward_motion();                     // Move the bot forward till it covers the specified distance
-    check_dist_travelled(dist);
+    avoid_state = AVOID_IDLE;
+    follow_stop();
+    avoid_gave_up = 1;
+    if(avoid_give_ups != 0xFF)
+        avoid_give_ups++;
 }
-//-----------------------------------------------------------------------
 
+// Function to return the distance (1/256 cm) from the bot to the next point of the path, by the odometry
+long avoid_point_distance()
+{
+    long x, y, dist = 0;
+    int theta;
 
-//Function to rotate to a specific angel and then move a certain distance
-//-----------------------------------------------------------------------
-void line_move(double dist, double angle)               // Move the bot along the line previously calculated
+    if(path_count)
+    {
+        get_pose(&x, &y, &theta);
+        heading_atan2(path_x[path_head] - x, path_y[path_head] - y, &dist);
+    }
+    return dist;
+}
+
+// Function to stop the current motion and start avoiding the obstacle found by the obstacle task
+void avoid_begin()
 {
-    if((angle - current_theta)>0)                      //if rotation angle is positive it starts right rotation.
-        Right_Rotation_Degrees(angle - current_theta);  //aligns the bot such that it face towards the final point.
+    long dist;
 
-    else if((angle - current_theta)<0)                  //if rotation angle is negative it starts left rotation.
-        Left_Rotation_Degrees(current_theta-angle);     //aligns the bot such that it face towards the final point.
+    disarm_stop_target();
+    stop_motion();
+    motion_mode = MOTION_IDLE;
+    obstacle_detected = 0;
+    set_node();                 // The point where the obstacle was found is left on the trail
 
-    move_forward((unsigned int)dist);                   //bot starts moving forward towards the final point.
+    dist = avoid_point_distance();
+    if(!avoid_attempts || dist + AVOID_PROGRESS <= avoid_best)
+    {
+        avoid_best = dist;      // Progress, the count starts again
+        avoid_attempts = 0;
+    }
+    if(++avoid_attempts > AVOID_ATTEMPTS)
+    {
+        avoid_give_up();
+        return;
+    }
 
+    avoid_turned_round = 0;
+    avoid_stamp = sched_now();
+    avoid_state = AVOID_LOOK;
 }
-//-----------------------------------------------------------------------
-
 
-/*
-Function to perform the required calculations of how much angle to rotate and the required distance
-to be moved to reach the required final point.
-The line_move is then called to start moving.
-*/
-//-----------------------------------------------------------------------
-void line_calc(double xfinal,double yfinal)
+// Function to return the direction of the route (next point of the path) from the heading of the bot
+int avoid_route_direction()
 {
-    double slopeangle, dist;
+    long x, y, dist;
+    int theta;
 
-    slopeangle = atan2(xfinal - current_x , yfinal - current_y) * (180/pi);  // Calculate the slope of line between the current position of the bot and the final point.
-    dist = sqrt(pow(yfinal-current_y,2) + pow(xfinal-current_x,2));          //Calculates distance to be moved along the line calculated above.
+    if(!path_count)
+        return 0;
+    get_pose(&x, &y, &theta);
+    return heading_normalize(heading_atan2(path_x[path_head] - x, path_y[path_head] - y, &dist) - theta);
+}
 
-    /**************************************************************************************************************************************************
-    While retreating back to its original position bot was showing around 15% error which was not acceptable.
-    So after large number of hit and trials we realized that if we reduce the speed of bot error reduces
-    significantly.
-    So we reduced the Pulse Width Modulation(PWM) of the motor which very much increased the accuracy of the bot.
-    Thus we reduced the speed of the bot and set it to (100,100)
-    **************************************************************************************************************************************************/
+void avoid_task()
+{
+    int cosine, goal, clear;
+    unsigned int move_dist;
 
-    velocity (80,80);
+    switch(avoid_state)
+    {
+        case AVOID_LOOK:
+            if(sched_now() - avoid_stamp < AVOID_SETTLE)
+                return;
+
+            goal = avoid_route_direction();
+            clear = field_pick(goal, (reference_distance + AVOID_CLEARANCE > AVOID_CLEAR_AWAY) ? reference_distance + AVOID_CLEARANCE : AVOID_CLEAR_AWAY);
+            if(clear == FIELD_BLOCKED)
+            {
+                if(avoid_turned_round)
+                {
+                    avoid_give_up();            // Boxed in
+                    return;
+                }
+                avoid_turned_round = 1;
+                start_left_rotation(HEADING_HALF);
+                avoid_state = AVOID_TURN_ROUND;
+                return;
+            }
+
+            avoid_turn = clear - goal;
+            avoid_free = field_free[FIELD_ANGLE_BIN(clear)];
+            start_rotate_to(get_heading() + clear);
+            avoid_state = AVOID_TURN;
+            break;
 
-    line_move(dist, slopeangle);                                                    //bot starts moving along the calculated line.
+        case AVOID_TURN_ROUND:
+        case AVOID_TURN:
+            if(!stop_target_reached)
+                return;
+            stop_motion();
+            motion_mode = MOTION_IDLE;
+            if(avoid_state == AVOID_TURN_ROUND)
+            {
+                avoid_stamp = sched_now();
+                avoid_state = AVOID_LOOK;
+                return;
+            }
+
+            cosine = heading_cos(avoid_turn);
+            if(cosine < SINE_ONE/16)                        // Past ~86 degrees, AVOID_SIDESTEP_MAX below takes over
+                cosine = SINE_ONE/16;
+            move_dist = 10L*SINE_ONE/cosine + 5;            //moving the distance proportional to the turn.
+            if(move_dist > AVOID_SIDESTEP_MAX)
+                move_dist = AVOID_SIDESTEP_MAX;
+            if(move_dist > (avoid_free - AVOID_CLEARANCE) / 10)
+                move_dist = (avoid_free - AVOID_CLEARANCE) / 10;
+            start_forward(move_dist);                       // Move the bot forward till obstacle is cleared
+            avoid_state = AVOID_SIDESTEP;
+            break;
 
+        case AVOID_SIDESTEP:
+            if(obstacle_detected)
+            {
+                avoid_begin();
+                return;
+            }
+            if(!stop_target_reached)
+                return;
+            stop_motion();
+            motion_mode = MOTION_IDLE;
+            set_node();                 // The end of the sidestep is left on the trail, so the way back goes round the obstacle too
+            avoid_state = AVOID_IDLE;
+            if(path_count)
+                follow_start();         // Rejoin the route
+            break;
+    }
 }
 //-----------------------------------------------------------------------
 
+
 /*
-Function to check if any obstacle in ahead of it at a distance lesser than the reference distance that is saved in
-the Global Variable reference_distance.
-If the obstacle is there the BCAS
-is activated.
+Planned return.
+plan_task drives the bot home along the route found by the planner (see planner.h) over the obstacles
+mapped so far, instead of a straight line that runs into them one after the other:
+
+PLAN_MISSION_SEARCH - the bot stands still while the search runs, PLAN_EXPANSIONS cells per run.
+PLAN_MISSION_DRIVE  - the corners of the route are handed to the path follower as it makes room for them,
+                      one per run.
+                      The next PLAN_CHECK_CELLS cells of the route are checked against the map on every
+                      run; when one of them has become blocked, or the obstacle avoidance had to take over,
+                      the bot stops and a new route is searched from where it is, with what has been seen.
+
+After PLAN_REPLANS new routes, or when no route is found, the bot falls back to the straight line.
+
+PLAN_MISSION_RETRACE - the way back is the trail (see trail.h) instead: its points, newest first, are
+                       handed to the path follower, over a way the bot has driven already. The return
+                       ends where the avoidance gives up (see avoid_give_up).
 */
 //-----------------------------------------------------------------------
-void avoiding_obstacle(double distance)
+#define PLAN_MISSION_IDLE   0
+#define PLAN_MISSION_SEARCH 1
+#define PLAN_MISSION_DRIVE  2
+#define PLAN_MISSION_RETRACE 3
+
+#define PLAN_EXPANSIONS     4
+#define PLAN_CHECK_CELLS    6
+#define PLAN_REPLANS        8
+
+unsigned char plan_mission = PLAN_MISSION_IDLE;
+unsigned char plan_replans = 0;
+unsigned char plan_route_read = 0;              // Set when the goal has been handed to the follower
+unsigned char plan_detoured = 0;                // Set when the obstacle avoidance took over on the route
+
+// Function to stop and search a route to the goal from the current position, straight to the goal if it cannot
+void plan_search()
 {
-    init_x = current_x;         //sets the initial co-ordinates to the the co-ordinates where the bot detected the obstacle.
-    init_y = current_y;         // new initial co-ordinated are the new node.distance travelled will now be measured from this point.
-    /*********************************************************************************************************************************
-    To minimize the returning path of the bot it was necessary that bot clears the obstacle proportional to the size of the obstacle.
-    To implement this we defined a counter which measures how many times bot have to turn to get clear from obstacle.Now the bot is
-    moved proportional to the counter thus clearing the obstacle and also reducing the path length at the same time.
-    *********************************************************************************************************************************/
-    int counter=0;                                         //initializing the counter value to zero.
-
-    while((unsigned int)distance<reference_distance+30)
+    long x, y;
+    int theta;
+
+    follow_stop();
+    avoid_gave_up = 0;
+    get_pose(&x, &y, &theta);
+    if(plan_replans++ < PLAN_REPLANS && plan_begin(x, y, plan_goal_x, plan_goal_y))
+        plan_mission = PLAN_MISSION_SEARCH;
+    else
     {
-        Left_Rotation_Degrees(25);                           // Turn the bot 25 degrees repeatedly till line of motion gets clear
-        unsigned char reading=Read_Sensor(11);
-        distance =convert(reading);
-
-        counter++;                                           //updating the counter.
+        plan_mission = PLAN_MISSION_IDLE;
+        path_add(plan_goal_x, plan_goal_y, PATH_NO_SEQUENCE);
     }
+}
 
-    double move_dist = 10/cos(25*pi*counter/180) + 5;        //moving the distance proportional to the counter.
+// Function to start the planned return to the point (x, y) in 1/256 cm
+void plan_start(long x, long y)
+{
+    plan_goal_x = x;
+    plan_goal_y = y;
+    plan_replans = 0;
+    plan_search();
+}
 
-    line_move(move_dist,current_theta);                 // Move the bot forward till obstacle is cleared
+void plan_task()
+{
+    long x, y;
+    int theta;
+    unsigned char result;
 
-    line_calc(0,0);                                   // Recalculate the line to be traversed
+    switch(plan_mission)
+    {
+        case PLAN_MISSION_SEARCH:
+            result = plan_step(PLAN_EXPANSIONS);
+            if(result == PLAN_FOUND)
+            {
+                plan_route_read = 0;
+                plan_detoured = 0;
+                plan_mission = PLAN_MISSION_DRIVE;
+            }
+            else if(result == PLAN_NO_ROUTE)
+            {
+                plan_replans = PLAN_REPLANS;
+                plan_search();          // Straight line
+            }
+            break;
+
+        case PLAN_MISSION_DRIVE:
+            if(avoid_state != AVOID_IDLE)
+            {
+                plan_detoured = 1;
+                return;
+            }
+            if(plan_detoured)
+            {
+                plan_search();
+                return;
+            }
+
+            if(!plan_route_read && path_count < PATH_POINTS)     // One corner per run, plan_next looks along the route for it
+            {
+                if(plan_next(&x, &y))
+                    path_add(x, y, PATH_NO_SEQUENCE);
+                else
+                    plan_route_read = 1;
+            }
+
+            if(plan_route_read && motion_mode != MOTION_FOLLOW && !path_count)
+            {
+                plan_mission = PLAN_MISSION_IDLE;           // Home
+                return;
+            }
+
+            get_pose(&x, &y, &theta);
+            if(!plan_route_clear(x, y, PLAN_CHECK_CELLS))
+                plan_search();
+            break;
+
+        case PLAN_MISSION_RETRACE:
+            if(avoid_gave_up)
+            {
+                plan_mission = PLAN_MISSION_IDLE;           // The rest of the trail is dropped too
+                return;
+            }
+            while(path_count < PATH_POINTS)
+            {
+                if(trail_pop(&x, &y))
+                    path_add(x, y, PATH_NO_SEQUENCE);
+                else if(trail_lost)
+                {
+                    trail_lost = 0;     // The start of the trail was dropped, the last leg is straight
+                    path_add(0, 0, PATH_NO_SEQUENCE);
+                }
+                else
+                    break;
+            }
+
+            if(!trail_count && !trail_lost && motion_mode != MOTION_FOLLOW && avoid_state == AVOID_IDLE && !path_count)
+                plan_mission = PLAN_MISSION_IDLE;
+            break;
+    }
 }
 //-----------------------------------------------------------------------
 
 
 /*************************************************
 This function activates the ARA ( Auto Return Algorithm ) and thereby tells the bot to return to (0,0)
->>>>>>> origin/master
-Therefore the function line_calc is called which calculates the required direction and distance to move to (0,0)
-and then tells the bot to rotate till that direction and start moving that required distance
-in that direction.
+The route home is planned around the obstacles seen on the way out (see plan_task) and the bot waits
+until it is home, or has given up on the planned routes and followed the straight line.
+Back home, a new trail and a new map (see grid.h) start for the next mission. A mission ended by a STOP
+(see stop_all), or given up (see avoid_give_up), keeps both, as the bot is not home, and recording goes
+on from where it stopped.
 *************************************************/
 //-----------------------------------------------------------------------
+unsigned char command_stopped = 0;              // Set by stop_all, cleared when a command waiting for its motion begins
+
 void backtracking()
 {
-    sei();
-    line_calc(0,0);
-    cli();
+    set_speed(cruise_speed, cruise_speed);
+    trail_recording = 0;
+    plan_start(0, 0);
+    while(plan_mission != PLAN_MISSION_IDLE)
+        sched_yield();
+    follow_wait();
+    if(!command_stopped && !avoid_gave_up)
+    {
+        trail_clear(0, 0);
+        grid_clear();
+    }
+    trail_recording = 1;
+}
+
+/*
+Function to return to (0,0) the way the bot came, along its trail (see trail.h).
+*/
+void retrace()
+{
+    set_speed(cruise_speed, cruise_speed);
+    follow_stop();
+    trail_recording = 0;
+    trail_window_count = 0;     // The nodes since the last corner are on the straight leg back to it
+    avoid_gave_up = 0;
+    plan_mission = PLAN_MISSION_RETRACE;
+    while(plan_mission != PLAN_MISSION_IDLE)
+        sched_yield();
+    follow_wait();
+    if(!command_stopped && !avoid_gave_up)      // Stopped on the way, the nodes not driven yet are still the way home
+    {
+        trail_clear(0, 0);
+        grid_clear();
+    }
+    trail_recording = 1;
 }
 //-----------------------------------------------------------------------
 
 
 /*
-Function to receive data from the serial port from the X-Bee and
-using it to move the Bot manually.
+Commands that wait for their motion.
+A key or a ROTATE_TO runs inside the command task and keeps calling sched_yield until its motion has
+finished. Between command_begin and command_end command_busy is set and the command task reads on
+(command_reading is cleared), so the frames received meanwhile are still parsed: a STOP is executed at
+once and ends the waiting command (see stop_all), the other frames are answered with STATUS_BUSY.
+Those frames are parsed into the same parse_payload, so a command takes what it needs from its payload
+before command_begin.
 */
 //-----------------------------------------------------------------------
+unsigned char command_busy = 0;         // A command is waiting for its motion
+unsigned char command_reading = 0;      // The command task is reading the receive buffer
 
-SIGNAL(SIG_USART0_RECV) 		// ISR for receive complete interrupt
+void command_begin()
 {
+    command_busy = 1;
+    command_reading = 0;
+    command_stopped = 0;
+}
 
-    data = UDR0; 				//making copy of data from UDR0 in 'data' variable
+void command_end()
+{
+    command_reading = 1;
+    command_busy = 0;
+}
 
-    UDR0 = data; 				//echo data back to PC so that we get to know that the data is recieved at the bot
+// Function to tell whether "data" is one of the keys of the keyboard control
+unsigned char command_key_valid(unsigned char data)
+{
+    return data == 0x32 || data == 0x34 || data == 0x36 || data == 0x37 || data == 0x38 || data == 0x39;
+}
+//-----------------------------------------------------------------------
+
+
+/*
+Function to execute a key of the keyboard control, received from the X-Bee as a raw byte in key mode or
+in a KEY frame (see command_receive), and using it to move the Bot manually.
+It runs from the command task, so the delays below no longer hold up any interrupt.
+*/
+//-----------------------------------------------------------------------
+
+void process_command(unsigned char data)
+{
+    command_begin();
 
-    Shaft_Counter_Left_Wheel = 0;
+    follow_wait();              //let a path being followed finish first
+    if(command_stopped)
+    {
+        command_end();          // Stopped while waiting, the key is dropped
+        return;
+    }
 
-    Shaft_Counter_Right_Wheel = 0;
+    reset_shaft_counters();
+    speed_resume();             // The keys run closed loop too, after a SET_VELOCITY
 
     unsigned char reading=Read_Sensor(11);
-    double distance =convert(reading);
+    unsigned int distance =convert(reading);
 
     /*
-    The Forward/Backward motion is switched on for 50 ms for a little forward/backward motion on pressing 8/2 on the keyboard once.
-    After 50 ms the motor is stopped but still a delay of 10 ms is provided to let the motor die down completely.
-    The required transversed distance is calculated from the shaft counters.
-    Then the new coordinates are calculated using the coordinate_calculation function in which distance travelled from the previous
-    node is mentioned
-    A new node is formed after that which is further used for any further motions.
+    The Forward/Backward motion is switched on for 64 ms for a little forward/backward motion on pressing 8/2 on the keyboard once.
+    After 64 ms the motor is stopped but still a delay of 20 ms is provided to let the motor die down completely.
+    The pose follows the motion through the odometry interrupt, including the coasting after the stop.
+    A new node is formed after that and left on the trail.
     */
 
     if(data == 0x38 && distance>reference_distance) //ASCII value of 8
     {
         forward_motion(); // Forward motion starts.
-
-        init_x = current_x;
-        init_y = current_y;
-
-        sei();
-        _delay_ms(64);
+        sched_wait(MS_TO_TICKS(64));
         stop_motion();
-        _delay_ms(20);
-        double dist_travelled = (Shaft_Counter_Left_Wheel+Shaft_Counter_Right_Wheel)*0.54;
-        cli();
-
-        coordinate_calculation(dist_travelled);
+        sched_wait(MS_TO_TICKS(20));
+        set_node();
     }
 
 
     if(data == 0x32) //ASCII value of 2
     {
         backward_motion(); //Backward Motion starts
-
-        sei();
-        _delay_ms(64);
-
+        sched_wait(MS_TO_TICKS(64));
         stop_motion();
-
-        _delay_ms(20);
-
-        double dist_travelled = ((Shaft_Counter_Left_Wheel+Shaft_Counter_Right_Wheel)/2)*0.54*2;
-        cli();
-
-        coordinate_calculation(-dist_travelled);
-
-        init_x = current_x;
-        init_y = current_y;
+        sched_wait(MS_TO_TICKS(20));
+        set_node();
     }
 
     /*
     The Left/Right motion is switched on for 50 ms for a little left/right rotation on pressing 4/6 on the keyboard once.
     After 50 ms the motor is stopped but still a delay of 10 ms is provided to let the motor die down completely.
-    The required turned angle is called on from the get_angle function and the calibrated value is subtracted/added to the current theta.
-    Thus the value of the global variable current_theta is updated.
+    The odometry interrupt turns current_theta with the bot.
     */
 
     if(data == 0x34) //ASCII value of 4
     {
         left_motion();  // Left Motion starts.
-        sei();
-        _delay_ms(50);
+        sched_wait(MS_TO_TICKS(50));
         stop_motion();
-        _delay_ms(10);
-        current_theta-=(get_angle()*3);
-        //cli();
-        if(current_theta>=0)
-        {
-            lcd_cursor(1,2);
-            lcd_string("+");
-            lcd_print(1,3,current_theta,4);
-        }
-        else
-        {
-            lcd_cursor(1,2);
-            lcd_string("-");
-            lcd_print(1,3, (-1 * current_theta),4);
-        }
+        sched_wait(MS_TO_TICKS(10));
+        set_node();
     }
 
 
     if(data == 0x36) //ASCII value of 6
     {
-
         right_motion();  // Right motion starts.
-        sei();
-        _delay_ms(50);
+        sched_wait(MS_TO_TICKS(50));
         stop_motion();
-        _delay_ms(10);
-        current_theta+=(get_angle()*3);
-        //cli();
-
-        /*
-        To Print the Current theta ( The angle from the Y-Axis )
-        The LCD cannot print negative values so that is taken care of
-        by the positive and negative signs that are displayed on the LCD
-        in case of the respective positive and negative values.
-        */
-
-        if(current_theta>=0)
-        {
-            lcd_cursor(1,2);
-            lcd_string("+");
-            lcd_print(1,3,current_theta,4);
-        }
-        else
-        {
-            lcd_cursor(1,2);
-            lcd_string("-");
-            lcd_print(1,3, (-1 * current_theta),4);
-        }
+        sched_wait(MS_TO_TICKS(10));
+        set_node();
     }
 
 
@@ -701,15 +1770,397 @@ SIGNAL(SIG_USART0_RECV) 		// ISR for receive complete interrupt
     }
 
 
+    if(data == 0x39) //ASCII value of 9
+    {
+        retrace();          // Return to (0,0) along the trail of nodes
+    }
+
+    command_end();
+}
+//-----------------------------------------------------------------------
+
+
+
+/*
+Binary command protocol.
+Commands use the same frame layout as the telemetry (see frame_begin) with the types below.
+Every valid frame is answered with a FRAME_ACK (sequence, command type, status) before it is executed;
+MOVE_TO and ROTATE_TO also send a FRAME_DONE (sequence, command type) when the motion has finished.
+A MOVE_TO whose point is dropped before the bot gets there (STOP, SET_VELOCITY, a new planned route or
+the avoidance boxed in) is answered with a FRAME_ABORTED (sequence, command type) instead.
+MOVE_TO does not wait for the motion: the point is added to the path of the follower (see follow_task),
+so a route sent as several MOVE_TO frames is driven without stopping at the points in between, and
+FRAME_DONE follows when the bot reaches or rounds the point. A MOVE_TO that finds the path full is
+acknowledged with STATUS_BUSY and must be sent again later. The other motion commands wait for the
+path to be finished first; STOP drops it.
+While a KEY or a ROTATE_TO waits for its motion (see command_begin), STOP, QUERY_STATE and QUERY_TASKS
+are executed and every other frame is acknowledged with STATUS_BUSY, to be sent again later. STOP ends
+the path, the avoidance, a mission of key 7 or 9 and a rotation.
+A frame with the same sequence number and type as the previous one is a retransmission after a lost
+acknowledgement: it is acknowledged again but not executed twice.
+
+Resync: after a length over COMMAND_MAX_LENGTH or a wrong CRC (counted in command_crc_errors) the bytes
+are dropped up to the next FRAME_START, and a frame whose next byte takes longer than COMMAND_GAP to
+come is given up; the PC retransmits when no acknowledgement arrives.
+
+Key mode: after a reset the bot is in key mode, and the keys of the keyboard control ('2', '4', '6',
+'7', '8', '9') received outside a frame are executed and echoed, so the bot can be driven from a
+terminal. Any other byte outside a frame is ignored, and after a broken frame keys are only taken
+again once the line has been quiet for COMMAND_GAP. The first valid frame ends key mode: from then
+on every byte outside a frame is dropped and keys are sent in KEY frames, until SET_KEYS turns key
+mode on again. Nothing is echoed outside key mode.
+
+    Type  Command          Payload
+    0x01  MOVE_TO          x (mm), y (mm)             - signed 16 bit
+    0x02  ROTATE_TO        angle (0.1 degree)         - signed 16 bit
+    0x03  SET_VELOCITY     left duty, right duty      - signed 16 bit, -1023 .. 1023, open loop, sign = direction;
+                                                        the next motion goes back to closed loop (see speed_resume)
+    0x04  SET_REFERENCE    reference distance (mm)    - 16 bit, 0 .. FIELD_MAX_RANGE
+    0x05  STOP             -
+    0x06  QUERY_STATE      -                          - answered with a FRAME_TELEMETRY
+    0x07  SET_BAUD         BAUD_9600 .. BAUD_921600   - applied after the acknowledgement is sent
+    0x08  SET_TELEMETRY    period (ticks), 0 = off    - 8 bit
+    0x09  KEY              keyboard command ('8', '2', '4', '6', '7', '9')
+    0x0A  SET_SPEED        left, right (cm/s)         - 8 bit, 1 .. 255, closed loop; paths are followed at the mean
+    0x0B  SET_TRIM         left, right (Q8, 256 = 1)  - 16 bit, 128 .. 256, kept in EEPROM
+    0x0C  SET_KEYS         1 = key mode on, 0 = off   - 8 bit
+    0x0D  QUERY_TASKS      -                          - answered with a FRAME_TASKS (see tasks_send)
+*/
+//-----------------------------------------------------------------------
+#define COMMAND_MOVE_TO       0x01
+#define COMMAND_ROTATE_TO     0x02
+#define COMMAND_SET_VELOCITY  0x03
+#define COMMAND_SET_REFERENCE 0x04
+#define COMMAND_STOP          0x05
+#define COMMAND_QUERY_STATE   0x06
+#define COMMAND_SET_BAUD      0x07
+#define COMMAND_SET_TELEMETRY 0x08
+#define COMMAND_KEY           0x09
+#define COMMAND_SET_SPEED     0x0A
+#define COMMAND_SET_TRIM      0x0B
+#define COMMAND_SET_KEYS      0x0C
+#define COMMAND_QUERY_TASKS   0x0D
+
+#define STATUS_OK          0
+#define STATUS_BAD_LENGTH  1
+#define STATUS_UNKNOWN     2
+#define STATUS_BAD_VALUE   3
+#define STATUS_BUSY        4
+
+#define COMMAND_MAX_LENGTH 16
+#define COMMAND_GAP        MS_TO_TICKS(100)     // Longest wait for the next byte of a frame
+
+#define PARSE_START    0
+#define PARSE_LENGTH   1
+#define PARSE_TYPE     2
+#define PARSE_SEQUENCE 3
+#define PARSE_PAYLOAD  4
+#define PARSE_CRC_HIGH 5
+#define PARSE_CRC_LOW  6
+#define PARSE_SYNC     7                        // Dropping bytes up to the next FRAME_START
+
+unsigned char parse_state = PARSE_START;
+unsigned char parse_length, parse_type, parse_sequence, parse_count;
+unsigned char parse_payload[COMMAND_MAX_LENGTH];
+unsigned int parse_crc, parse_received_crc;
+unsigned char last_command_type = 0, last_command_sequence = 0;
+unsigned char command_crc_errors = 0;
+unsigned char command_keys = 1;                 // Key mode, see above
+unsigned int command_stamp = 0;                 // Tick the last byte was read at
+
+int payload_int(unsigned char index)
+{
+    return (int16_t)(parse_payload[index] | (parse_payload[index + 1] << 8));
+}
+
+// Function to check the payload length of a command, returns the status to acknowledge
+unsigned char command_length(unsigned char type, unsigned char length)
+{
+    unsigned char expected;
+
+    switch(type)
+    {
+        case COMMAND_MOVE_TO:       expected = 4; break;
+        case COMMAND_ROTATE_TO:     expected = 2; break;
+        case COMMAND_SET_VELOCITY:  expected = 4; break;
+        case COMMAND_SET_REFERENCE: expected = 2; break;
+        case COMMAND_STOP:          expected = 0; break;
+        case COMMAND_QUERY_STATE:   expected = 0; break;
+        case COMMAND_SET_BAUD:      expected = 1; break;
+        case COMMAND_SET_TELEMETRY: expected = 1; break;
+        case COMMAND_KEY:           expected = 1; break;
+        case COMMAND_SET_SPEED:     expected = 2; break;
+        case COMMAND_SET_TRIM:      expected = 4; break;
+        case COMMAND_SET_KEYS:      expected = 1; break;
+        case COMMAND_QUERY_TASKS:   expected = 0; break;
+        default: return STATUS_UNKNOWN;
+    }
+    return (length == expected) ? STATUS_OK : STATUS_BAD_LENGTH;
+}
+
+void send_ack(unsigned char sequence, unsigned char type, unsigned char status)
+{
+    frame_begin(FRAME_ACK, 3);
+    frame_byte(sequence);
+    frame_byte(type);
+    frame_byte(status);
+    frame_end();
+}
+
+void send_done(unsigned char sequence, unsigned char type)
+{
+    frame_begin(FRAME_DONE, 2);
+    frame_byte(sequence);
+    frame_byte(type);
+    frame_end();
+}
+
+// Function called by the path follower when the point of a MOVE_TO has been reached
+void move_done(unsigned char sequence)
+{
+    send_done(sequence, COMMAND_MOVE_TO);
+}
+
+// Function called by the path follower when the point of a MOVE_TO is dropped before it is reached
+void move_aborted(unsigned char sequence)
+{
+    frame_begin(FRAME_ABORTED, 2);
+    frame_byte(sequence);
+    frame_byte(COMMAND_MOVE_TO);
+    frame_end();
+}
+
+/*
+Function to stop whatever the bot is doing: the path, the avoidance, a mission of key 7 or 9 and a
+rotation. The command waiting for the motion, if any, sees it end and returns.
+*/
+void stop_all()
+{
+    plan_mission = PLAN_MISSION_IDLE;
+    command_stopped = 1;
+    follow_stop();
+    disarm_stop_target();
+    stop_motion();
+    motion_mode = MOTION_IDLE;
+    stop_target_reached = 1;                    // Ends wait_motion
+}
+
+// Function to acknowledge and execute a complete, CRC checked command frame
+void execute_frame()
+{
+    unsigned char type = parse_type, sequence = parse_sequence;
+    unsigned char status = command_length(type, parse_length);
+    int angle;
+
+    command_keys = 0;                           // A host sending frames, the keys come in KEY frames now
+
+    if(status == STATUS_OK && command_busy && type != COMMAND_STOP && type != COMMAND_QUERY_STATE && type != COMMAND_QUERY_TASKS)
+        status = STATUS_BUSY;
+    if(status == STATUS_OK && type == COMMAND_SET_BAUD && parse_payload[0] >= BAUD_RATES)
+        status = STATUS_BAD_VALUE;
+    if(status == STATUS_OK && type == COMMAND_SET_REFERENCE && (payload_int(0) < 0 || payload_int(0) > FIELD_MAX_RANGE))
+        status = STATUS_BAD_VALUE;
+    if(status == STATUS_OK && type == COMMAND_KEY && !command_key_valid(parse_payload[0]))
+        status = STATUS_BAD_VALUE;
+    if(status == STATUS_OK && type == COMMAND_SET_SPEED && (parse_payload[0] == 0 || parse_payload[1] == 0))
+        status = STATUS_BAD_VALUE;              // A wheel that never turns never reaches a stop target
+    if(status == STATUS_OK && type == COMMAND_MOVE_TO && path_count == PATH_POINTS)
+        status = STATUS_BUSY;
+    if(status == STATUS_OK && type == COMMAND_SET_TRIM && !(motor_trim_valid(payload_int(0)) && motor_trim_valid(payload_int(2))))
+        status = STATUS_BAD_VALUE;
+
+    if(status == STATUS_OK && type == last_command_type && sequence == last_command_sequence)
+    {
+        send_ack(sequence, type, STATUS_OK);    // Retransmission, the command was already executed
+        return;
+    }
+
+    send_ack(sequence, type, status);
+    if(status != STATUS_OK)
+        return;
+
+    last_command_type = type;
+    last_command_sequence = sequence;
+
+    switch(type)
+    {
+        case COMMAND_MOVE_TO:
+            path_add(((long)payload_int(0) << 8) / 10, ((long)payload_int(2) << 8) / 10, sequence);
+            break;
+        case COMMAND_ROTATE_TO:
+            angle = (long)payload_int(0) * HEADING_FULL / 3600;    // Taken before waiting, the frames parsed meanwhile overwrite the payload
+            command_begin();
+            follow_wait();
+            if(!command_stopped)
+                rotate_to(angle);
+            command_end();
+            send_done(sequence, type);
+            break;
+        case COMMAND_SET_VELOCITY:
+            follow_stop();
+            speed_control = 0;                  // Raw PWM, the speed controllers let go
+            motor_set(payload_int(0), payload_int(2));
+            break;
+        case COMMAND_SET_TRIM:
+            motor_set_trim(payload_int(0), payload_int(2));
+            break;
+        case COMMAND_SET_SPEED:
+            set_speed(parse_payload[0], parse_payload[1]);
+            cruise_speed = (parse_payload[0] + parse_payload[1]) / 2;   // For the path follower
+            break;
+        case COMMAND_SET_REFERENCE:
+            reference_distance = payload_int(0);
+            break;
+        case COMMAND_STOP:
+            stop_all();
+            break;
+        case COMMAND_QUERY_STATE:
+            telemetry_send();
+            break;
+        case COMMAND_SET_BAUD:
+            uart0_set_baud(parse_payload[0]);
+            break;
+        case COMMAND_SET_TELEMETRY:
+            sched_set_period(TASK_TELEMETRY, parse_payload[0]);
+            break;
+        case COMMAND_KEY:
+            process_command(parse_payload[0]);
+            break;
+        case COMMAND_SET_KEYS:
+            command_keys = (parse_payload[0] != 0);
+            break;
+        case COMMAND_QUERY_TASKS:
+            tasks_send();
+            break;
+    }
+}
+
+// Function to feed one received byte to the frame parser
+void command_receive(unsigned char data)
+{
+    unsigned int now = sched_now();
+
+    if(now - command_stamp > COMMAND_GAP)
+        parse_state = PARSE_START;              // A frame left broken is given up, the line was quiet
+    command_stamp = now;
+
+    switch(parse_state)
+    {
+        case PARSE_START:
+            if(data == FRAME_START)
+                parse_state = PARSE_LENGTH;
+            else if(command_keys && !command_busy && command_key_valid(data))
+            {
+                uart0_write(data);              //echo the key back to PC so that we get to know that it is received at the bot
+                process_command(data);          // Keyboard control
+            }
+            return;
+
+        case PARSE_SYNC:
+            if(data == FRAME_START)
+                parse_state = PARSE_LENGTH;
+            return;
+
+        case PARSE_LENGTH:
+            if(data > COMMAND_MAX_LENGTH)
+            {
+                parse_state = PARSE_SYNC;
+                return;
+            }
+            parse_length = data;
+            parse_crc = hal_crc_xmodem(0, data);
+            parse_state = PARSE_TYPE;
+            return;
+
+        case PARSE_TYPE:
+            parse_type = data;
+            parse_crc = hal_crc_xmodem(parse_crc, data);
+            parse_state = PARSE_SEQUENCE;
+            return;
+
+        case PARSE_SEQUENCE:
+            parse_sequence = data;
+            parse_crc = hal_crc_xmodem(parse_crc, data);
+            parse_count = 0;
+            parse_state = parse_length ? PARSE_PAYLOAD : PARSE_CRC_HIGH;
+            return;
+
+        case PARSE_PAYLOAD:
+            parse_payload[parse_count++] = data;
+            parse_crc = hal_crc_xmodem(parse_crc, data);
+            if(parse_count == parse_length)
+                parse_state = PARSE_CRC_HIGH;
+            return;
+
+        case PARSE_CRC_HIGH:
+            parse_received_crc = data << 8;
+            parse_state = PARSE_CRC_LOW;
+            return;
+
+        case PARSE_CRC_LOW:
+            if((parse_received_crc | data) != parse_crc)
+            {
+                parse_state = PARSE_SYNC;
+                command_crc_errors++;
+                return;
+            }
+            parse_state = PARSE_START;
+            execute_frame();
+            return;
+    }
 }
 //-----------------------------------------------------------------------
 
 
 
+/*
+Task table of the scheduler, in priority order.
+A command that starts a motion runs inside the command task while the motion loops keep calling
+sched_yield. command_reading stops the task from being entered again while it reads, except while a
+command waits for its motion (see command_begin), when the task reads on to let a STOP through.
+*/
+//-----------------------------------------------------------------------
+void command_task()
+{
+    unsigned char command;
+
+    if(command_reading)
+        return;
+
+    command_reading = 1;
+    while(uart0_read(&command))
+        command_receive(command);
+    command_reading = 0;
+}
+
+sched_task sched_tasks[] =
+{
+    // run             period          budget
+    {field_task,       8,              2 * SCHED_TICK_COUNTS},   // Before the tasks that use the obstacle field
+    {follow_task,      SPEED_PERIOD,   2 * SCHED_TICK_COUNTS},   // Sets the wheel speeds before the speed task
+    {speed_task,       SPEED_PERIOD,   SCHED_TICK_COUNTS},
+    {obstacle_task,    4,              SCHED_TICK_COUNTS},
+    {avoid_task,       4,              SCHED_TICK_COUNTS},
+    {grid_task,        8,              2 * SCHED_TICK_COUNTS},   // After the field task has read the sensors
+    {plan_task,        4,              2 * SCHED_TICK_COUNTS},
+    {command_task,     1,              SCHED_NO_BUDGET},     // Includes the motions started by the command
+    {telemetry_send,   51,             SCHED_TICK_COUNTS},   // ~20 frames per second
+    {display_task,     102,            SCHED_TICK_COUNTS},   // ~10 updates per second
+    {lcd_flush_step,   1,              SCHED_TICK_COUNTS}
+};
+const unsigned char sched_task_count = sizeof(sched_tasks) / sizeof(sched_tasks[0]);
+//-----------------------------------------------------------------------
+
+
+
 int main()
 {
     initialize();              // Initializes all the ports
+    set_speed(cruise_speed, cruise_speed);     // The motions run closed loop from the start
     lcd_init();				   // Initializes the LCD
     init_xbee();			   // Initializes the X-Bee
-    while(1);
+    sched_init();
+
+    while(1)
+        sched_yield();
 }
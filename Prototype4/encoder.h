@@ -0,0 +1,128 @@
+/*
+Timestamped shaft encoder edges.
+
+INT4 and INT5 trigger on both edges of the encoder signals, which gives 176 counts per turn of the
+bot instead of 88. Every edge is stamped with TIMER1, which runs free at 230400 counts per second
+(4.34 us). The slots of the encoder disc are not exactly as wide as the bars, so two successive
+edges are not equally far apart; the period is therefore taken over the last two edges (one slot
+and one bar), which always covers the same part of the disc.
+
+encoder_speed turns the period into counts per second as soon as an edge arrives, instead of
+waiting for enough counts to pile up in a fixed window. While no edge comes, the time since the last
+edge bounds the speed from above, so a stalling wheel is seen before its next edge.
+TIMER1 wraps every 284 ms; encoder_check is called at a fixed rate (from the odometry interrupt)
+and forgets the stamps of a wheel that has not moved for ENCODER_TIMEOUT, so a period is never
+taken across a wrap.
+
+The interrupts also keep the running count of each wheel. Everything an interrupt writes is
+bracketed by the wheel's sequence counter (see seqlock.h), and the main loop reads it through
+encoder_read, which never disables the interrupts.
+*/
+
+#define ENCODER_TIMER_HZ	HAL_CLOCK_HZ		// TIMER1 counts per second
+#define ENCODER_TIMEOUT		46080			// 200 ms, the slowest measured speed is 10 counts/s
+#define ENCODER_STOPPED		0xFFFF
+
+typedef struct
+{
+	seqlock sequence;				// Odd while an interrupt is writing the fields below
+	unsigned int ticks;				// Running count of edges, never reset
+	unsigned int stamp;				// TIMER1 at the last edge
+	unsigned int previous;			// TIMER1 at the edge before
+	unsigned int period;			// TIMER1 counts over the last two edges, ENCODER_STOPPED if unknown
+	unsigned char edges;			// Edges stamped since the wheel last stopped, up to 2
+} wheel_encoder;
+
+#define ENCODER_INIT	{0, 0, 0, 0, ENCODER_STOPPED, 0}
+
+// Consistent copy of the state of a wheel, taken by encoder_read
+typedef struct
+{
+	unsigned int ticks;
+	unsigned int stamp;
+	unsigned int period;
+	unsigned int now;				// TIMER1 when the copy was taken
+} encoder_state;
+
+
+// Function called from the encoder interrupt on every edge
+void encoder_edge(wheel_encoder *encoder)
+{
+	unsigned int now = hal_timer_now();
+
+	seq_write(&encoder->sequence);
+	encoder->ticks++;
+	if(encoder->edges >= 2)
+		encoder->period = now - encoder->previous;
+	else
+		encoder->edges++;
+	encoder->previous = encoder->stamp;
+	encoder->stamp = now;
+	seq_write(&encoder->sequence);
+}
+
+
+// Function called from an interrupt, at least every ENCODER_TIMEOUT, to drop the stamps of a stopped wheel
+void encoder_check(wheel_encoder *encoder)
+{
+	if(encoder->edges && (unsigned int)(hal_timer_now() - encoder->stamp) > ENCODER_TIMEOUT)
+	{
+		seq_write(&encoder->sequence);
+		encoder->edges = 0;
+		encoder->period = ENCODER_STOPPED;
+		seq_write(&encoder->sequence);
+	}
+}
+
+
+// Function to take a consistent copy of the count, last stamp and period of a wheel
+void encoder_read(wheel_encoder *encoder, encoder_state *state)
+{
+	unsigned char start;
+
+	do
+	{
+		start = seq_read_begin(&encoder->sequence);
+		state->ticks = encoder->ticks;
+		state->stamp = encoder->stamp;
+		state->period = encoder->period;
+		state->now = hal_timer_now();
+	} while(seq_read_retry(&encoder->sequence, start));
+}
+
+
+// Function to return the running count of a wheel
+unsigned int encoder_ticks(wheel_encoder *encoder)
+{
+	encoder_state state;
+
+	encoder_read(encoder, &state);
+	return state.ticks;
+}
+
+
+// Function to return the period of the last two edges in TIMER1 counts, ENCODER_STOPPED if the wheel is not moving
+unsigned int encoder_period(wheel_encoder *encoder)
+{
+	encoder_state state;
+
+	encoder_read(encoder, &state);
+	return state.period;
+}
+
+
+// Function to return the speed of a wheel in counts per second
+int encoder_speed(wheel_encoder *encoder)
+{
+	encoder_state state;
+	unsigned int since;
+
+	encoder_read(encoder, &state);
+	since = state.now - state.stamp;
+
+	if(state.period == ENCODER_STOPPED)
+		return 0;
+	if(since > state.period)		// Slower than the last period, the next edge is late
+		state.period = since;
+	return 2 * ENCODER_TIMER_HZ / state.period;
+}
@@ -0,0 +1,100 @@
+/*
+Polar obstacle field.
+
+All the range sensors are put together in a free space histogram over the front half of the bot:
+FIELD_BINS directions from 90 degrees left to 90 degrees right, FIELD_BIN_WIDTH apart, and for each
+the distance (mm) the bot can drive in that direction before it would touch something seen.
+
+An obstacle seen by a sensor mounted at angle a, at range r, is a point at d = r + FIELD_SENSOR_RIM
+from the centre of the bot along a, as the sensors sit on the rim. Driving in direction h, the bot
+passes it sideways at d * sin(a - h) and its front reaches it after d * cos(a - h) - FIELD_SENSOR_RIM;
+when the sideways distance is less than FIELD_HALF_WIDTH (half the bot plus a margin) the point limits
+the free distance of direction h. So a single reading closes every direction the bot could not squeeze
+past it, not only the one the sensor looks along, and directions between two sensors are covered.
+
+The Sharp sensors measure up to FIELD_MAX_RANGE; the IR proximity sensors only tell that something is
+within about FIELD_IR_RANGE, which is taken as their range. Angles are in heading units relative
+to the front of the bot, positive to the right like the heading.
+*/
+
+#define FIELD_SENSORS		10
+#define FIELD_BINS			13
+#define FIELD_CENTER		6							// Bin straight ahead
+#define FIELD_BIN_WIDTH		DEG_TO_HEADING(15)
+#define FIELD_MAX_RANGE		800							// mm, reach of the Sharp GP2D12
+#define FIELD_IR_RANGE		80							// mm
+#define FIELD_HALF_WIDTH	120							// mm
+#define FIELD_SENSOR_RIM	80							// mm from the centre of the bot to the sensors
+#define FIELD_NO_RANGE		0xFFFF						// Nothing seen
+#define FIELD_BLOCKED		0x7FFF						// No clear direction
+
+#define FIELD_BIN_ANGLE(bin)	(((int)(bin) - FIELD_CENTER) * FIELD_BIN_WIDTH)
+#define FIELD_ANGLE_BIN(angle)	((angle) / FIELD_BIN_WIDTH + FIELD_CENTER)	// Bin of an angle given by field_pick
+
+// Mounting angles of the sensors, Sharp 1 to 5 (ADC channels 9 to 13) then IR proximity 1 to 5 (channels 4 to 8)
+const int field_sensor_angle[FIELD_SENSORS] =
+{
+	DEG_TO_HEADING(-90), DEG_TO_HEADING(-45), 0, DEG_TO_HEADING(45), DEG_TO_HEADING(90),
+	DEG_TO_HEADING(-90), DEG_TO_HEADING(-45), 0, DEG_TO_HEADING(45), DEG_TO_HEADING(90)
+};
+
+unsigned int field_free[FIELD_BINS];					// Free distance of each direction, mm
+
+
+// Function to rebuild the histogram from the ranges (mm, FIELD_NO_RANGE if nothing seen) of all the sensors
+void field_build(const unsigned int *range)
+{
+	unsigned char sensor, bin;
+	int offset;
+	long distance, ahead, side;
+
+	for(bin = 0; bin < FIELD_BINS; bin++)
+		field_free[bin] = FIELD_MAX_RANGE;
+
+	for(sensor = 0; sensor < FIELD_SENSORS; sensor++)
+	{
+		if(range[sensor] >= FIELD_MAX_RANGE)
+			continue;
+		distance = (long)range[sensor] + FIELD_SENSOR_RIM;
+
+		for(bin = 0; bin < FIELD_BINS; bin++)
+		{
+			offset = field_sensor_angle[sensor] - FIELD_BIN_ANGLE(bin);
+			if(offset >= HEADING_QUARTER || offset <= -HEADING_QUARTER)
+				continue;							// Behind the bot when driving this way
+
+			side = (distance * heading_sin(offset)) >> 14;
+			if(side >= FIELD_HALF_WIDTH || side <= -FIELD_HALF_WIDTH)
+				continue;
+
+			ahead = ((distance * heading_cos(offset)) >> 14) - FIELD_SENSOR_RIM;
+			if(ahead < 0)
+				ahead = 0;
+			if(ahead < field_free[bin])
+				field_free[bin] = ahead;
+		}
+	}
+}
+
+
+// Function to return the clear direction closest to "goal" in which the bot can drive at least "needed" mm, or FIELD_BLOCKED
+int field_pick(int goal, unsigned int needed)
+{
+	unsigned char bin;
+	int angle, best = FIELD_BLOCKED, error, best_error = 0x7FFF;
+
+	for(bin = 0; bin < FIELD_BINS; bin++)
+	{
+		if(field_free[bin] < needed)
+			continue;
+
+		angle = FIELD_BIN_ANGLE(bin);
+		error = (angle > goal) ? angle - goal : goal - angle;
+		if(error < best_error)
+		{
+			best_error = error;
+			best = angle;
+		}
+	}
+	return best;
+}
@@ -0,0 +1,133 @@
+/*
+Occupancy grid.
+
+The arena around the start point is divided into GRID_SIZE x GRID_SIZE square cells of GRID_CELL_CM,
+the start point in the middle. Each cell holds a 2 bit counter of the evidence that it is occupied,
+four cells to a byte, so the 64 x 64 grid of 10 cm cells (6.4 m square) takes 1 kB of SRAM:
+
+    0       - nothing seen there, or seen free
+    1       - seen occupied once
+    2, 3    - occupied (GRID_OCCUPIED and above)
+
+A Sharp reading is a ray from the bot along the sensor: every cell the ray crosses before the range is
+seen free and counts down, the cell at the range counts up. A single wrong reading does not make an
+obstacle and an obstacle that has gone is cleared by the readings passing through it.
+The sensors sit GRID_SENSOR_RIM from the centre of the bot, which is added to the ranges.
+
+A ray of the full range is walked in about 18 steps, each two divisions of a long, so the caller
+enters one sensor at a time rather than all five in one go.
+The map holds the obstacles of one mission: grid_clear forgets it when the bot is back home.
+*/
+
+#define GRID_SIZE			64						// Cells per side
+#define GRID_CELL_CM		10
+#define GRID_BYTES			(GRID_SIZE * GRID_SIZE / 4)
+#define GRID_MAX_BYTES		2048					// Share of the 8 kB of SRAM the grid may take
+#define GRID_OUTSIDE		-1
+#define GRID_OCCUPIED		2
+#define GRID_SENSOR_RIM		FIELD_SENSOR_RIM
+#define GRID_FREE_RANGE		500						// mm seen free when a sensor sees nothing
+
+typedef char grid_fits_in_budget[(GRID_BYTES <= GRID_MAX_BYTES) ? 1 : -1];
+
+unsigned char grid[GRID_BYTES];
+
+
+// Function to return the cell column (or row) of a coordinate in 1/256 cm, GRID_OUTSIDE if off the grid
+int grid_cell(long q8)
+{
+	long cell = q8 >> 8;									// Whole cm, rounded down
+
+	cell = ((cell >= 0) ? cell : cell - GRID_CELL_CM + 1) / GRID_CELL_CM + GRID_SIZE / 2;
+	return (cell >= 0 && cell < GRID_SIZE) ? (int)cell : GRID_OUTSIDE;
+}
+
+
+// Function to return the counter of a cell
+unsigned char grid_get(unsigned char cx, unsigned char cy)
+{
+	unsigned int index = (unsigned int)cy * GRID_SIZE + cx;
+
+	return (grid[index >> 2] >> ((index & 3) * 2)) & 0x03;
+}
+
+
+// Function to count the evidence of a cell up (hit) or down
+void grid_mark(unsigned char cx, unsigned char cy, unsigned char hit)
+{
+	unsigned int index = (unsigned int)cy * GRID_SIZE + cx;
+	unsigned char shift = (index & 3) * 2;
+	unsigned char value = (grid[index >> 2] >> shift) & 0x03;
+
+	if(hit && value < 3)
+		value++;
+	else if(!hit && value > 0)
+		value--;
+	else
+		return;
+
+	grid[index >> 2] = (grid[index >> 2] & ~(0x03 << shift)) | (value << shift);
+}
+
+
+// Function to tell whether a cell is occupied
+unsigned char grid_occupied(unsigned char cx, unsigned char cy)
+{
+	return grid_get(cx, cy) >= GRID_OCCUPIED;
+}
+
+
+// Function to forget the whole map
+void grid_clear()
+{
+	unsigned int i;
+
+	for(i = 0; i < GRID_BYTES; i++)
+		grid[i] = 0;
+}
+
+
+/*
+Function to enter one reading: a ray from (x, y) (1/256 cm) along "heading", "length" mm long,
+that ends on an obstacle if "hit" is set. The ray is walked half a cell at a time.
+*/
+void grid_ray(long x, long y, int heading, unsigned int length, unsigned char hit)
+{
+	long step_x, step_y, reach;
+	int sine = heading_sin(heading), cosine = heading_cos(heading);
+	int cx, cy, end_x, end_y, last_x = GRID_OUTSIDE, last_y = GRID_OUTSIDE;
+	unsigned int steps;
+
+	reach = ((long)length << 8) / 10;						// mm to 1/256 cm
+	end_x = grid_cell(x + scale_q14(reach, sine));
+	end_y = grid_cell(y + scale_q14(reach, cosine));
+
+	step_x = scale_q14(CM_TO_Q8(GRID_CELL_CM) / 2, sine);
+	step_y = scale_q14(CM_TO_Q8(GRID_CELL_CM) / 2, cosine);
+	for(steps = length / (GRID_CELL_CM * 5); steps; steps--)
+	{
+		cx = grid_cell(x);
+		cy = grid_cell(y);
+		if(cx == GRID_OUTSIDE || cy == GRID_OUTSIDE)
+			return;
+		if((cx != last_x || cy != last_y) && !(hit && cx == end_x && cy == end_y))
+			grid_mark(cx, cy, 0);
+		last_x = cx;
+		last_y = cy;
+		x += step_x;
+		y += step_y;
+	}
+
+	if(hit && end_x != GRID_OUTSIDE && end_y != GRID_OUTSIDE)
+		grid_mark(end_x, end_y, 1);
+}
+
+
+// Function to enter the range (mm) of a Sharp sensor mounted at "angle" from the front, seen from the pose
+void grid_update(long x, long y, int theta, unsigned int range, int angle)
+{
+	if(range < FIELD_MAX_RANGE)
+		grid_ray(x, y, theta + angle, range + GRID_SENSOR_RIM, 1);
+	else
+		grid_ray(x, y, theta + angle, GRID_FREE_RANGE, 0);
+}
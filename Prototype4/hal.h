@@ -0,0 +1,49 @@
+/*
+Hardware abstraction layer.
+
+Everything the firmware does to the hardware goes through the small interface below, so the control
+code above it (odometry, speed control, avoidance, mapping and planning) never touches a register and
+builds for another target as it is. There are two backends:
+
+hal_avr.h  - the ATmega2560 of the Firebird V. Every function is a static inline register access, so
+             the build for the bot compiles to the same instructions as the registers written in place.
+hal_host.h - a Linux host (HAL_HOST defined), for the simulator and for running or profiling the control
+             code natively. The hardware is a set of variables and hooks of the host program.
+
+Interrupts     HAL_ISR(vector) defines the routine of an interrupt vector, named as on the AVR without
+               _vect (INT4, ADC, USART0_RX, ...). hal_irq_disable / hal_irq_enable, and hal_irq_save /
+               hal_irq_restore for a section that may be entered with the interrupts off.
+Sleep          hal_sleep_init, and hal_sleep, called with the interrupts off, which enables them and
+               sleeps until the next interrupt without losing one that comes in between.
+Delays         hal_delay_us / hal_delay_ms, busy waits of a constant time.
+Timers         hal_timer_init starts the free running clock of HAL_CLOCK_HZ read by hal_timer_now, the
+               scheduler tick (TIMER2_COMPA) every HAL_TICK_COUNTS and the odometry update (TIMER4_COMPA)
+               every HAL_ODOMETRY_COUNTS counts of the clock. hal_timer_now is atomic, so it can be
+               called from the main loop and from an interrupt alike.
+Motors         hal_motor_init, hal_motor_direction to write the direction bits of both wheels at once
+               (MOTOR_LEFT_BACK ... in motor.h), hal_motor_direction_read, and hal_motor_duty to set the
+               duty of each wheel, 0 .. HAL_MOTOR_TOP.
+Encoders       hal_encoder_init enables an interrupt (INT4 left, INT5 right) on every edge.
+ADC            hal_adc_init, hal_adc_select to route a channel (0-15), hal_adc_start to start a
+               conversion, which ends with the ADC interrupt, and hal_adc_result for its 8 bit result.
+UART0          hal_uart_init and hal_uart_set_ubrr for the baud rate, hal_uart_data for the byte received
+               (USART0_RX), hal_uart_send for the next byte to send and hal_uart_tx_interrupt to turn the
+               interrupt that asks for it (USART0_UDRE) on and off. hal_uart_sent tells whether the last
+               byte has left.
+LCD            hal_lcd_init, and hal_lcd_nibble to clock the upper 4 bits of a byte into the controller.
+Memories       HAL_FLASH places a constant table in program memory, read with hal_flash_word.
+               HAL_EEPROM places a variable in EEPROM, read with hal_eeprom_read_word and written with
+               hal_eeprom_update_word.
+CRC            hal_crc_xmodem adds a byte to a CRC-16/XMODEM.
+*/
+
+#define HAL_CLOCK_HZ			230400L			// 14745600 / 64, 4.34 us per count
+#define HAL_TICK_COUNTS			225				// 1024 Hz
+#define HAL_ODOMETRY_COUNTS		900				// 256 Hz
+#define HAL_MOTOR_TOP			1023
+
+#ifdef HAL_HOST
+#include "hal_host.h"
+#else
+#include "hal_avr.h"
+#endif
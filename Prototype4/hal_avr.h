@@ -0,0 +1,281 @@
+/*
+AVR backend of the HAL (see hal.h): the registers of the ATmega2560 at 14.7456 MHz.
+
+PORTA 0-3    - direction inputs of the L293D, PL3 / PL4 its enables, driven by OC5A / OC5B
+PORTC        - the LCD in 4 bit mode (RS, RW, EN and D4-D7 on PC0-2 and PC4-7)
+INT4 / INT5  - position encoders of the left and right wheel (PE4 / PE5)
+PORTF, PORTK - ADC channels 0-7 and 8-15
+TIMER1       - free running clock, TIMER2 scheduler tick, TIMER4 odometry update, TIMER5 motor PWM
+*/
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+#include <util/delay.h>
+#include <avr/pgmspace.h>
+#include <util/crc16.h>
+#include <avr/eeprom.h>
+
+#define RS 0
+#define RW 1
+#define EN 2
+#define lcd_port PORTC
+
+#define sbit(reg,bit)	reg |= (1<<bit)			// Macro defined for Setting a bit of any register.
+#define cbit(reg,bit)	reg &= ~(1<<bit)		// Macro defined for Clearing a bit of any register.
+
+#define HAL_ISR(vector)		ISR(vector##_vect)
+
+#define hal_delay_us(us)	_delay_us(us)
+#define hal_delay_ms(ms)	_delay_ms(ms)
+
+#define HAL_FLASH			PROGMEM
+#define hal_flash_word(address)	pgm_read_word(address)
+#define HAL_EEPROM			EEMEM
+
+
+//Interrupts and sleep
+//-----------------------------------------------------------------------
+static inline void hal_irq_disable(void)
+{
+	cli();
+}
+
+static inline void hal_irq_enable(void)
+{
+	sei();
+}
+
+static inline unsigned char hal_irq_save(void)
+{
+	unsigned char sreg = SREG;
+
+	cli();
+	return sreg;
+}
+
+static inline void hal_irq_restore(unsigned char sreg)
+{
+	SREG = sreg;
+}
+
+static inline void hal_sleep_init(void)
+{
+	set_sleep_mode(SLEEP_MODE_IDLE);
+}
+
+static inline void hal_sleep(void)
+{
+	sleep_enable();
+	sei();						// The instruction after sei is executed before any interrupt, so no wake up is lost
+	sleep_cpu();
+	sleep_disable();
+}
+//-----------------------------------------------------------------------
+
+
+/* Function To Initialize the timers, all with prescaler 64
+   TIMER1: free running clock, one count is 4.34 us and the counter wraps every 284 ms
+   TIMER2: scheduler tick, CTC, 14745600 / 64 / 225 = 1024 Hz
+   TIMER4: odometry clock, CTC, 14745600 / 64 / 900 = 256 Hz */
+
+static inline void hal_timer_init(void)
+{
+	TCCR1A = 0x00;
+	TCNT1 = 0x0000;
+	TCCR1B = 0x03;
+
+	TCCR2B = 0x00;						//stop while setting up
+	TCNT2 = 0x00;
+	TCCR2A = 0x02;						//CTC mode
+	OCR2A = HAL_TICK_COUNTS - 1;		//225 counts per tick
+	TIMSK2 = 0x02;						//enable compare match A interrupt
+	TCCR2B = 0x04;						//start with prescaler 64
+
+	TCCR4B = 0x00;						//stop while setting up
+	TCNT4 = 0x0000;
+	TCCR4A = 0x00;
+	OCR4A = HAL_ODOMETRY_COUNTS - 1;	//900 counts per update
+	TIMSK4 = 0x02;						//enable compare match A interrupt
+	TCCR4B = 0x0B;						//CTC mode, start with prescaler 64
+}
+
+/* TCNT1 is read through the TEMP register, which the encoder and odometry interrupts use as well;
+   one of them coming between the two byte reads would tear the value, so the interrupts are held off. */
+static inline unsigned int hal_timer_now(void)
+{
+	unsigned char sreg = hal_irq_save();
+	unsigned int now = TCNT1;
+
+	hal_irq_restore(sreg);
+	return now;
+}
+
+
+/* Function to configure the motion pins, enable the L293D and set up TIMER5
+   mode 10, phase correct PWM with TOP in ICR5, no prescaler: 14745600 / (2 * 1023) = 7.2 kHz
+   Every register of the timer is set, so nothing depends on what the bootloader left. */
+
+static inline void hal_motor_init(void)
+{
+	DDRA = 0x0F;
+	PORTA = 0x00;
+	DDRL = 0x18;
+	PORTL = 0x18;
+
+	TCCR5B = 0x00;					//stop while setting up
+	TCNT5 = 0x0000;
+	ICR5 = HAL_MOTOR_TOP;			//TOP
+	OCR5A = 0x0000;
+	OCR5B = 0x0000;
+	TCCR5A = 0xA2;					//non inverting PWM on OC5A and OC5B, WGM51
+	TCCR5B = 0x11;					//WGM53: phase correct PWM with TOP in ICR5, start without prescaler
+}
+
+static inline void hal_motor_direction(unsigned char direction)
+{
+	PORTA = direction;				// One write, the encoder interrupts may clear PORTA at any time
+}
+
+static inline unsigned char hal_motor_direction_read(void)
+{
+	return PORTA & 0x0F;
+}
+
+static inline void hal_motor_duty(unsigned int left, unsigned int right)
+{
+	OCR5A = left;
+	OCR5B = right;
+}
+
+
+//Function to configure INT4 (PE4) and INT5 (PE5) as inputs with pull-ups, interrupting on both edges
+static inline void hal_encoder_init(void)
+{
+	DDRE  = DDRE & 0xCF;			//Set the direction of the PORTE 4 and 5 pins as input
+	PORTE = PORTE | 0x30;			//Enable internal pull-up for PORTE 4 and 5 pins
+	EICRB = (EICRB & 0xF0) | 0x05;	// INT4 and INT5 are set to trigger on both edges
+	EIMSK = EIMSK | 0x30;			// Enable Interrupt INT4 and INT5 for the position encoders
+}
+
+
+//ADC: AVCC reference, left adjusted 8 bit results, prescaler 64
+//-----------------------------------------------------------------------
+static inline void hal_adc_init(void)
+{
+	DDRF = 0x00;
+	DDRK = 0x00;
+	DIDR0 = 0xFF;					// Digital input buffers off on the analog pins
+	DIDR2 = 0x3F;
+	ACSR = 0x80;
+	ADCSRA = 0x8E;					// ADC enabled, interrupt enabled, prescaler 64
+}
+
+static inline void hal_adc_select(unsigned char channel)
+{
+	if(channel>7)
+		ADCSRB = 0x08;
+	else
+		ADCSRB = 0x00;
+	ADMUX = 0x20 | (channel & 0x07);	// AVCC reference, left adjusted result
+}
+
+static inline void hal_adc_start(void)
+{
+	ADCSRA = ADCSRA | 0x40;
+}
+
+static inline unsigned char hal_adc_result(void)
+{
+	return ADCH;
+}
+//-----------------------------------------------------------------------
+
+
+/* UART0
+   char size: 8 bit
+   parity: Disabled */
+//-----------------------------------------------------------------------
+static inline void hal_uart_init(unsigned char ubrr)
+{
+	UCSR0B = 0x00; //disable while setting baud rate
+	UCSR0A = 0x00;
+	UCSR0C = 0x06;
+	UBRR0L = ubrr; //set baud rate low
+	UBRR0H = 0x00; //set baud rate high
+	UCSR0B = 0x98;
+}
+
+static inline void hal_uart_set_ubrr(unsigned char ubrr)
+{
+	UBRR0L = ubrr;
+}
+
+static inline unsigned char hal_uart_data(void)
+{
+	return UDR0;
+}
+
+static inline void hal_uart_send(unsigned char data)
+{
+	UCSR0A = UCSR0A | 0x40;			// Clear TXC0 by writing 1 to it
+	UDR0 = data;
+}
+
+static inline void hal_uart_tx_interrupt(unsigned char on)
+{
+	if(on)
+		UCSR0B = UCSR0B | 0x20;		// Enable UDRIE0
+	else
+		UCSR0B = UCSR0B & ~0x20;	// Disable UDRIE0
+}
+
+// TXC0 is cleared with every byte written to UDR0, so it is only set again when the last byte has left
+static inline unsigned char hal_uart_sent(void)
+{
+	return UCSR0A & 0x40;
+}
+//-----------------------------------------------------------------------
+
+
+//LCD
+//-----------------------------------------------------------------------
+static inline void hal_lcd_init(void)
+{
+	DDRC = 0xF7;
+	PORTC = 0x28;
+}
+
+static inline void hal_lcd_nibble(unsigned char nibble, unsigned char rs)
+{
+	lcd_port &= 0x0F;
+	lcd_port |= (nibble & 0xF0);
+	if(rs)
+		sbit(lcd_port,RS);
+	else
+		cbit(lcd_port,RS);
+	cbit(lcd_port,RW);
+	sbit(lcd_port,EN);				//Enable pulse width must be at least 450 ns
+	_delay_us(1);
+	cbit(lcd_port,EN);
+}
+//-----------------------------------------------------------------------
+
+
+//EEPROM and CRC
+//-----------------------------------------------------------------------
+static inline unsigned int hal_eeprom_read_word(const unsigned int *address)
+{
+	return eeprom_read_word((const uint16_t *)address);
+}
+
+static inline void hal_eeprom_update_word(unsigned int *address, unsigned int value)
+{
+	eeprom_update_word((uint16_t *)address, value);	// Only written if changed, to spare the EEPROM
+}
+
+static inline unsigned int hal_crc_xmodem(unsigned int crc, unsigned char data)
+{
+	return _crc_xmodem_update(crc, data);
+}
+//-----------------------------------------------------------------------
@@ -0,0 +1,235 @@
+/*
+Host backend of the HAL (see hal.h), for building the firmware on Linux with HAL_HOST defined.
+
+The hardware is a set of variables and hooks defined by the host program (the simulator, see sim/sim.c,
+or a benchmark). The host reads what the firmware drives (the motor directions and duties, the ADC
+channel, the bytes sent), drives the inputs (the clock, the ADC result, the byte received) and calls the
+interrupt routines, hal_isr_<vector>, while hal_host_interrupts is set, as the AVR would. The firmware's
+time only passes when it sleeps or waits, in hal_host_sleep and hal_host_delay_us.
+
+hal_host_clock is as wide as an unsigned int and is never wrapped at 16 bits: on the host an int has
+32 bits, so the differences of clock stamps the firmware takes only stay right if the clock does not wrap.
+
+The program memory tables are plain constants, the EEPROM variables stay in RAM, zero at the start,
+which the firmware takes as erased EEPROM just as it takes 0xFFFF, and the LCD is not there at all.
+This header is also included by the host program, for the declarations.
+*/
+
+#include <stdint.h>
+
+#define HAL_ISR(vector)		void hal_isr_##vector(void)
+
+#define hal_delay_us(us)	hal_host_delay_us(us)
+#define hal_delay_ms(ms)	hal_host_delay_us((ms) * 1000.0)
+
+#define HAL_FLASH
+#define hal_flash_word(address)	(*(address))
+#define HAL_EEPROM
+
+// The hardware, defined by the host program
+extern volatile unsigned char hal_host_interrupts;		// Global interrupt enable, the I bit of SREG
+extern volatile unsigned int hal_host_clock;			// HAL_CLOCK_HZ
+extern volatile unsigned char hal_host_timers;			// Set once the tick and odometry interrupts run
+extern volatile unsigned char hal_host_direction;		// Direction bits of both wheels, PORTA 0-3
+extern volatile unsigned int hal_host_duty[2];			// Duty of the left and right wheel, 0 .. HAL_MOTOR_TOP
+extern volatile unsigned char hal_host_encoders;		// Set once the encoder interrupts are enabled
+extern volatile unsigned char hal_host_adc_channel;		// Channel routed to the converter
+extern volatile unsigned char hal_host_adc_busy;		// Set while a conversion runs
+extern volatile unsigned char hal_host_adc_result;
+extern volatile unsigned char hal_host_uart_enabled;	// Set once UART0 receives
+extern volatile unsigned char hal_host_uart_ubrr;
+extern volatile unsigned char hal_host_uart_data;		// Byte received
+extern volatile unsigned char hal_host_uart_tx;			// Set while the firmware asks for bytes to send
+
+void hal_host_sleep(void);								// Runs the time on until an interrupt has been taken
+void hal_host_delay_us(double us);
+void hal_host_uart_send(unsigned char data);
+
+// The interrupt routines, defined by the firmware with HAL_ISR
+void hal_isr_INT4(void);
+void hal_isr_INT5(void);
+void hal_isr_TIMER2_COMPA(void);
+void hal_isr_TIMER4_COMPA(void);
+void hal_isr_ADC(void);
+void hal_isr_USART0_RX(void);
+void hal_isr_USART0_UDRE(void);
+
+
+//Interrupts and sleep
+//-----------------------------------------------------------------------
+static inline void hal_irq_disable(void)
+{
+	hal_host_interrupts = 0;
+}
+
+static inline void hal_irq_enable(void)
+{
+	hal_host_interrupts = 1;
+}
+
+static inline unsigned char hal_irq_save(void)
+{
+	unsigned char interrupts = hal_host_interrupts;
+
+	hal_host_interrupts = 0;
+	return interrupts;
+}
+
+static inline void hal_irq_restore(unsigned char interrupts)
+{
+	hal_host_interrupts = interrupts;
+}
+
+static inline void hal_sleep_init(void)
+{
+}
+
+static inline void hal_sleep(void)
+{
+	hal_host_interrupts = 1;
+	hal_host_sleep();
+}
+//-----------------------------------------------------------------------
+
+
+static inline void hal_timer_init(void)
+{
+	hal_host_clock = 0;
+	hal_host_timers = 1;
+}
+
+static inline unsigned int hal_timer_now(void)
+{
+	return hal_host_clock;
+}
+
+
+static inline void hal_motor_init(void)
+{
+	hal_host_direction = 0x00;
+	hal_host_duty[0] = 0;
+	hal_host_duty[1] = 0;
+}
+
+static inline void hal_motor_direction(unsigned char direction)
+{
+	hal_host_direction = direction;
+}
+
+static inline unsigned char hal_motor_direction_read(void)
+{
+	return hal_host_direction & 0x0F;
+}
+
+static inline void hal_motor_duty(unsigned int left, unsigned int right)
+{
+	hal_host_duty[0] = left;
+	hal_host_duty[1] = right;
+}
+
+
+static inline void hal_encoder_init(void)
+{
+	hal_host_encoders = 1;
+}
+
+
+//ADC
+//-----------------------------------------------------------------------
+static inline void hal_adc_init(void)
+{
+	hal_host_adc_busy = 0;
+}
+
+static inline void hal_adc_select(unsigned char channel)
+{
+	hal_host_adc_channel = channel & 0x0F;
+}
+
+static inline void hal_adc_start(void)
+{
+	hal_host_adc_busy = 1;
+}
+
+static inline unsigned char hal_adc_result(void)
+{
+	return hal_host_adc_result;
+}
+//-----------------------------------------------------------------------
+
+
+//UART0
+//-----------------------------------------------------------------------
+static inline void hal_uart_init(unsigned char ubrr)
+{
+	hal_host_uart_ubrr = ubrr;
+	hal_host_uart_tx = 0;
+	hal_host_uart_enabled = 1;
+}
+
+static inline void hal_uart_set_ubrr(unsigned char ubrr)
+{
+	hal_host_uart_ubrr = ubrr;
+}
+
+static inline unsigned char hal_uart_data(void)
+{
+	return hal_host_uart_data;
+}
+
+static inline void hal_uart_send(unsigned char data)
+{
+	hal_host_uart_send(data);
+}
+
+static inline void hal_uart_tx_interrupt(unsigned char on)
+{
+	hal_host_uart_tx = on;
+}
+
+static inline unsigned char hal_uart_sent(void)
+{
+	return 1;								// The host takes every byte as it comes
+}
+//-----------------------------------------------------------------------
+
+
+static inline void hal_lcd_init(void)
+{
+}
+
+static inline void hal_lcd_nibble(unsigned char nibble, unsigned char rs)
+{
+	(void)nibble;
+	(void)rs;
+}
+
+
+//EEPROM and CRC
+//-----------------------------------------------------------------------
+static inline unsigned int hal_eeprom_read_word(const unsigned int *address)
+{
+	return *address;
+}
+
+static inline void hal_eeprom_update_word(unsigned int *address, unsigned int value)
+{
+	*address = value;
+}
+
+// Function to add a byte to a CRC-16/XMODEM, the same as _crc_xmodem_update of avr-libc
+static inline unsigned int hal_crc_xmodem(unsigned int crc, unsigned char data)
+{
+	unsigned char i;
+
+	crc = (crc ^ ((unsigned int)data << 8)) & 0xFFFF;
+	for(i = 0; i < 8; i++)
+	{
+		if(crc & 0x8000)
+			crc = ((crc << 1) ^ 0x1021) & 0xFFFF;
+		else
+			crc = (crc << 1) & 0xFFFF;
+	}
+	return crc;
+}
+//-----------------------------------------------------------------------
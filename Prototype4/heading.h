@@ -0,0 +1,167 @@
+/*
+Fixed point headings and distances for the odometry.
+
+Headings are integers tied to the shaft encoders: turning in place, one count of the wheels
+(2.05 degrees, 176 counts for 360 degrees with both edges counted) is HEADING_PER_COUNT units,
+so a full turn is HEADING_FULL = 176 * 8 = 1408 units.
+
+Positions are signed 32 bit in 1/256 cm (Q8 cm). One count of a wheel is 0.27 cm,
+which is DIST_Q12_PER_COUNT / 4096 cm.
+
+Sines are read from a quarter wave table in flash, 353 entries for 0 to 90 degrees in Q14
+(16384 = 1.0). Like the Sharp tables, every entry is a constant expression folded by the compiler.
+*/
+
+#define ENCODER_COUNTS		176				// Counts of each wheel for a full turn in place
+#define HEADING_PER_COUNT	8
+#define HEADING_FULL		(ENCODER_COUNTS * HEADING_PER_COUNT)
+#define HEADING_HALF		(HEADING_FULL / 2)
+#define HEADING_QUARTER		(HEADING_FULL / 4)
+
+#define DEG_TO_HEADING(deg)		((int)((long)(deg) * HEADING_FULL / 360))
+#define HEADING_TO_DEG(h)		((int)((long)(h) * 360 / HEADING_FULL))
+
+#define DIST_Q12_PER_COUNT	1106			// 0.27 cm * 4096
+#define CM_TO_Q8(cm)		((long)(cm) << 8)
+#define Q8_TO_CM(q)			((int)((q) >> 8))
+
+#define SINE_ONE			16384
+#define SINE_ENTRY(u)		((int)(SINE_ONE * sin((u) * 3.14159265358979 / 2 / HEADING_QUARTER) + 0.5))
+#define SINE_ROW4(u)		SINE_ENTRY(u), SINE_ENTRY(u+1), SINE_ENTRY(u+2), SINE_ENTRY(u+3)
+#define SINE_ROW16(u)		SINE_ROW4(u), SINE_ROW4(u+4), SINE_ROW4(u+8), SINE_ROW4(u+12)
+#define SINE_ROW32(u)		SINE_ROW16(u), SINE_ROW16(u+16)
+
+const int sine_quarter[HEADING_QUARTER + 1] HAL_FLASH =
+{
+	SINE_ROW32(0), SINE_ROW32(32), SINE_ROW32(64), SINE_ROW32(96),
+	SINE_ROW32(128), SINE_ROW32(160), SINE_ROW32(192), SINE_ROW32(224),
+	SINE_ROW32(256), SINE_ROW32(288), SINE_ROW32(320),
+	SINE_ENTRY(HEADING_QUARTER)
+};
+
+
+// Function to bring a heading into -HEADING_HALF .. HEADING_HALF - 1
+int heading_normalize(int heading)
+{
+	while(heading >= HEADING_HALF)
+		heading -= HEADING_FULL;
+	while(heading < -HEADING_HALF)
+		heading += HEADING_FULL;
+	return heading;
+}
+
+
+// Function to return the sine of a heading in Q14
+int heading_sin(int heading)
+{
+	unsigned int u;
+	int value;
+
+	heading = heading_normalize(heading);
+	u = (heading < 0) ? heading + HEADING_FULL : heading;		// 0 .. HEADING_FULL - 1
+
+	if(u < HEADING_QUARTER)
+		value = hal_flash_word(&sine_quarter[u]);
+	else if(u < HEADING_HALF)
+		value = hal_flash_word(&sine_quarter[HEADING_HALF - u]);
+	else if(u < HEADING_HALF + HEADING_QUARTER)
+		value = -(int)hal_flash_word(&sine_quarter[u - HEADING_HALF]);
+	else
+		value = -(int)hal_flash_word(&sine_quarter[HEADING_FULL - u]);
+
+	return value;
+}
+
+
+// Function to return the cosine of a heading in Q14
+int heading_cos(int heading)
+{
+	return heading_sin(heading + HEADING_QUARTER);
+}
+
+
+// Function to return "length" (Q8 cm) times the sine (or cosine) "trig" (Q14)
+// Whole centimetres and the fraction are multiplied separately so no product overflows 32 bits
+long scale_q14(long length, int trig)
+{
+	return (((length >> 8) * trig) >> 6) + (((length & 0xFF) * trig) >> 14);
+}
+
+
+/*
+CORDIC vectoring for the direction and length of a vector.
+The vector is rotated onto the Y axis in CORDIC_STEPS shift-and-add steps while the rotations are
+summed from cordic_atan (atan(2^-i) in 1/64 heading units). The components are first shifted up so
+the largest one uses 28 bits, which keeps the precision for short vectors; the result is rounded to
+whole heading units (0.26 degree, well below the 2.05 degrees of one encoder count).
+The length comes out multiplied by the CORDIC gain 1.6468, which is removed with CORDIC_GAIN_Q15.
+*/
+
+#define CORDIC_STEPS		14
+#define CORDIC_ANGLE(i)		((int)(atan(1.0 / (1L << (i))) * HEADING_HALF * 64 / 3.14159265358979 + 0.5))
+#define CORDIC_GAIN_Q15		19898			// 1 / 1.6468 in Q15
+
+const int cordic_atan[CORDIC_STEPS] HAL_FLASH =
+{
+	CORDIC_ANGLE(0), CORDIC_ANGLE(1), CORDIC_ANGLE(2), CORDIC_ANGLE(3), CORDIC_ANGLE(4),
+	CORDIC_ANGLE(5), CORDIC_ANGLE(6), CORDIC_ANGLE(7), CORDIC_ANGLE(8), CORDIC_ANGLE(9),
+	CORDIC_ANGLE(10), CORDIC_ANGLE(11), CORDIC_ANGLE(12), CORDIC_ANGLE(13)
+};
+
+
+/*
+Function to return the heading of the vector (x, y) measured from the Y axis, like the pose
+(x = r sin(heading), y = r cos(heading)), and to store its length in "length" (same units as x and y).
+*/
+int heading_atan2(long x, long y, long *length)
+{
+	long a = y, b = x, next;
+	long biggest;
+	int angle = 0, offset = 0;
+	unsigned char i, shift = 0;
+
+	if(a < 0)				// Turn the vector by half a turn so the iterations only cover -90 .. 90 degrees
+	{
+		offset = (b >= 0) ? HEADING_HALF : -HEADING_HALF;
+		a = -a;
+		b = -b;
+	}
+
+	biggest = (a > b) ? a : b;
+	if(-b > biggest)
+		biggest = -b;
+	if(biggest == 0)
+	{
+		*length = 0;
+		return 0;
+	}
+	while(biggest < (1L << 28))
+	{
+		biggest <<= 1;
+		shift++;
+	}
+	a <<= shift;
+	b <<= shift;
+
+	for(i = 0; i < CORDIC_STEPS; i++)
+	{
+		if(b > 0)
+		{
+			next = a + (b >> i);
+			b = b - (a >> i);
+			angle += hal_flash_word(&cordic_atan[i]);
+		}
+		else
+		{
+			next = a - (b >> i);
+			b = b + (a >> i);
+			angle -= hal_flash_word(&cordic_atan[i]);
+		}
+		a = next;
+	}
+
+	a = ((a >> 15) * CORDIC_GAIN_Q15) + (((a & 0x7FFF) * CORDIC_GAIN_Q15) >> 15);
+	*length = (a + ((1L << shift) >> 1)) >> shift;
+
+	return heading_normalize(offset + ((angle + 32) >> 6));
+}
@@ -1,148 +1,165 @@
-#define RS 0
-#define RW 1
-#define EN 2
-#define lcd_port PORTC
+#define LCD_ROWS 2
+#define LCD_COLS 16
+#define LCD_NO_CELL 0xFF
+#define LCD_EXEC_COUNTS ((37 * HAL_CLOCK_HZ + 999999) / 1000000 + 1)	// Clock counts that surely hold 37 us
 
-#define sbit(reg,bit)	reg |= (1<<bit)			// Macro defined for Setting a bit of any register.
-#define cbit(reg,bit)	reg &= ~(1<<bit)		// Macro defined for Clearing a bit of any register.
-
-void init_ports();
-void lcd_reset();
+void lcd_set_4bit();
 void lcd_init();
 void lcd_wr_command(unsigned char);
 void lcd_wr_char(char);
-void lcd_line1();
-void lcd_line2();
+void lcd_put_char(char);
+void lcd_flush_step();
+void lcd_home();
 void lcd_string(char*);
-
-unsigned int temp;
-unsigned int unit;
-unsigned int tens;
-unsigned int hundred;
-unsigned int thousand;
-unsigned int million;
-
-/*//Function to configure LCD port
-void lcd_port_config (void)
+void lcd_cursor(char, char);
+void lcd_print(char, char, unsigned int, int);
+
+/*
+The display is driven from a shadow framebuffer.
+lcd_cursor, lcd_string and lcd_print only write into lcd_buffer and mark the changed cells in lcd_dirty,
+so they cost a few microseconds and never touch the bus.
+lcd_flush_step is run as the last scheduler task of every tick and sends at most one command or character
+per call. A late run can be followed by the run of the next tick within microseconds, so every write is
+stamped with hal_timer_now and the step does nothing until the 37 us execution time of the HD44780 has
+passed since the last one; no busy waiting is needed.
+*/
+char lcd_buffer[LCD_ROWS][LCD_COLS];
+volatile unsigned int lcd_dirty[LCD_ROWS];			// One bit per column, set by the writers and cleared by the flush
+unsigned char lcd_cur_row = 0, lcd_cur_col = 0;	// Virtual cursor used by the writers
+unsigned char lcd_next_cell = LCD_NO_CELL;			// Cell the address counter of the LCD is pointing at
+volatile unsigned char lcd_ready = 0;				// Set once lcd_init has finished so the flush may use the bus
+unsigned int lcd_bus_stamp = 0;						// hal_timer_now of the last write of the flush
+
+//Function to clock one nibble (upper 4 bits of "nibble") into the LCD
+void lcd_wr_nibble(unsigned char nibble, unsigned char rs)
 {
- DDRC = DDRC | 0xF7; //all the LCD pin's direction set as output
- PORTC = PORTC & 0x80; // all the LCD pins are set to logic 0 except PORTC 7
-}*/
-
-
+	hal_lcd_nibble(nibble, rs);
+}
 
 //Function to Reset LCD
 void lcd_set_4bit()
 {
-	_delay_ms(1);
-
-	cbit(lcd_port,RS);				//RS=0 --- Command Input
-	cbit(lcd_port,RW);				//RW=0 --- Writing to LCD
-	lcd_port = 0x30;				//Sending 3
-	sbit(lcd_port,EN);				//Set Enable Pin
-	_delay_ms(5);					//Delay
-	cbit(lcd_port,EN);				//Clear Enable Pin
-
-	_delay_ms(1);
-
-	cbit(lcd_port,RS);				//RS=0 --- Command Input
-	cbit(lcd_port,RW);				//RW=0 --- Writing to LCD
-	lcd_port = 0x30;				//Sending 3
-	sbit(lcd_port,EN);				//Set Enable Pin
-	_delay_ms(5);					//Delay
-	cbit(lcd_port,EN);				//Clear Enable Pin
-
-	_delay_ms(1);
-
-	cbit(lcd_port,RS);				//RS=0 --- Command Input
-	cbit(lcd_port,RW);				//RW=0 --- Writing to LCD
-	lcd_port = 0x30;				//Sending 3
-	sbit(lcd_port,EN);				//Set Enable Pin
-	_delay_ms(5);					//Delay
-	cbit(lcd_port,EN);				//Clear Enable Pin
-
-	_delay_ms(1);
-
-	cbit(lcd_port,RS);				//RS=0 --- Command Input
-	cbit(lcd_port,RW);				//RW=0 --- Writing to LCD
-	lcd_port = 0x20;				//Sending 2 to initialise LCD 4-bit mode
-	sbit(lcd_port,EN);				//Set Enable Pin
-	_delay_ms(5);					//Delay
-	cbit(lcd_port,EN);				//Clear Enable Pin
-
-	
+	hal_delay_ms(15);				//Power on time of the controller
+
+	lcd_wr_nibble(0x30,0);			//Sending 3
+	hal_delay_ms(5);
+
+	lcd_wr_nibble(0x30,0);			//Sending 3
+	hal_delay_us(150);
+
+	lcd_wr_nibble(0x30,0);			//Sending 3
+	hal_delay_us(150);
+
+	lcd_wr_nibble(0x20,0);			//Sending 2 to initialise LCD 4-bit mode
+	hal_delay_us(50);
 }
 
 //Function to Initialize LCD
 void lcd_init()
 {
+	unsigned char row, col;
+
+	lcd_ready = 0;
 	lcd_set_4bit();
-	_delay_ms(1);
 
 	lcd_wr_command(0x28);			//LCD 4-bit mode and 2 lines.
-	lcd_wr_command(0x01);
+	hal_delay_us(50);
+	lcd_wr_command(0x01);			//Clear display takes 1.52 ms
+	hal_delay_ms(2);
 	lcd_wr_command(0x06);
-	lcd_wr_command(0x0E);
-	lcd_wr_command(0x80);
-		
+	hal_delay_us(50);
+	lcd_wr_command(0x0C);			//Display on, cursor off as the flush moves it around
+	hal_delay_us(50);
+
+	for(row = 0; row < LCD_ROWS; row++)
+	{
+		for(col = 0; col < LCD_COLS; col++)
+			lcd_buffer[row][col] = ' ';
+		lcd_dirty[row] = 0;
+	}
+	lcd_cur_row = 0;
+	lcd_cur_col = 0;
+	lcd_next_cell = LCD_NO_CELL;
+	lcd_ready = 1;
 }
 
-	 
-//Function to Write Command on LCD
+
+//Function to Write Command on LCD (no delay, the caller must respect the execution time)
 void lcd_wr_command(unsigned char cmd)
 {
-	unsigned char temp;
-	temp = cmd;
-	temp = temp & 0xF0;
-	lcd_port &= 0x0F;
-	lcd_port |= temp;
-	cbit(lcd_port,RS);
-	cbit(lcd_port,RW);
-	sbit(lcd_port,EN);
-	_delay_ms(5);
-	cbit(lcd_port,EN);
-	
-	cmd = cmd & 0x0F;
-	cmd = cmd<<4;
-	lcd_port &= 0x0F;
-	lcd_port |= cmd;
-	cbit(lcd_port,RS);
-	cbit(lcd_port,RW);
-	sbit(lcd_port,EN);
-	_delay_ms(5);
-	cbit(lcd_port,EN);
+	lcd_wr_nibble(cmd,0);
+	lcd_wr_nibble(cmd<<4,0);
 }
 
-//Function to Write Data on LCD
+//Function to Write Data on LCD (no delay, the caller must respect the execution time)
 void lcd_wr_char(char letter)
 {
-	char temp;
-	temp = letter;
-	temp = (temp & 0xF0);
-	lcd_port &= 0x0F;
-	lcd_port |= temp;
-	sbit(lcd_port,RS);
-	cbit(lcd_port,RW);
-	sbit(lcd_port,EN);
-	_delay_ms(5);
-	cbit(lcd_port,EN);
-
-	letter = letter & 0x0F;
-	letter = letter<<4;
-	lcd_port &= 0x0F;
-	lcd_port |= letter;
-	sbit(lcd_port,RS);
-	cbit(lcd_port,RW);
-	sbit(lcd_port,EN);
-	_delay_ms(5);
-	cbit(lcd_port,EN);
+	lcd_wr_nibble(letter,1);
+	lcd_wr_nibble(letter<<4,1);
+}
+
+
+/*
+Function to send the next changed cell of the framebuffer to the LCD.
+Characters are written one per call; an address command is only needed when the next dirty cell
+is not the one the LCD address counter already points at.
+The dirty bit is cleared before the character is read, so a write racing with the flush is sent again.
+*/
+void lcd_flush_step()
+{
+	unsigned char row, col, cell;
+	unsigned int mask;
+
+	if(!lcd_ready || hal_timer_now() - lcd_bus_stamp < LCD_EXEC_COUNTS)
+		return;
+
+	cell = lcd_next_cell;
+	if(cell != LCD_NO_CELL && (lcd_dirty[cell / LCD_COLS] & (1U << (cell % LCD_COLS))))
+	{
+		row = cell / LCD_COLS;
+		col = cell % LCD_COLS;
+		lcd_dirty[row] &= ~(1U << col);
+		lcd_wr_char(lcd_buffer[row][col]);
+		lcd_bus_stamp = hal_timer_now();
+		lcd_next_cell = (col == LCD_COLS - 1) ? LCD_NO_CELL : cell + 1;	// Row 1 ends at 0x0F, row 2 starts at 0x40
+		return;
+	}
+
+	for(row = 0; row < LCD_ROWS; row++)
+	{
+		mask = lcd_dirty[row];
+		if(mask == 0)
+			continue;
+		for(col = 0; !(mask & 1); col++)
+			mask >>= 1;
+		lcd_wr_command((row ? 0xC0 : 0x80) + col);
+		lcd_bus_stamp = hal_timer_now();
+		lcd_next_cell = row * LCD_COLS + col;
+		return;
+	}
+}
+
+
+//Function to write one character at the cursor into the framebuffer
+void lcd_put_char(char letter)
+{
+	if(lcd_cur_row < LCD_ROWS && lcd_cur_col < LCD_COLS)
+	{
+		if(lcd_buffer[lcd_cur_row][lcd_cur_col] != letter)
+		{
+			lcd_buffer[lcd_cur_row][lcd_cur_col] = letter;
+			lcd_dirty[lcd_cur_row] |= (1U << lcd_cur_col);
+		}
+	}
+	lcd_cur_col++;
 }
 
 
 //Function to bring cursor at home position
 void lcd_home()
 {
-	lcd_wr_command(0x80);
+	lcd_cur_row = 0;
+	lcd_cur_col = 0;
 }
 
 
@@ -151,7 +168,7 @@ void lcd_string(char *str)
 {
 	while(*str != '\0')
 	{
-		lcd_wr_char(*str);
+		lcd_put_char(*str);
 		str++;
 	}
 }
@@ -160,13 +177,8 @@ void lcd_string(char *str)
 
 void lcd_cursor (char row, char column)
 {
-	switch (row) {
-		case 1: lcd_wr_command (0x80 + column - 1); break;
-		case 2: lcd_wr_command (0xc0 + column - 1); break;
-		case 3: lcd_wr_command (0x94 + column - 1); break;
-		case 4: lcd_wr_command (0xd4 + column - 1); break;
-		default: break;
-	}
+	lcd_cur_row = row - 1;			// Rows 3 and 4 do not exist on the 2x16 display and are dropped by lcd_put_char
+	lcd_cur_col = column - 1;
 }
 
 //Function To Print Any input value upto the desired digit on LCD
@@ -183,41 +195,33 @@ void lcd_print (char row, char coloumn, unsigned int value, int digits)
 	}
 	if(digits==5 || flag==1)
 	{
-		million=value/10000+48;
-		lcd_wr_char(million);
+		lcd_put_char(value/10000 + 48);
 		flag=1;
 	}
 	if(digits==4 || flag==1)
 	{
-		temp = value/1000;
-		thousand = temp%10 + 48;
-		lcd_wr_char(thousand);
+		lcd_put_char((value/1000)%10 + 48);
 		flag=1;
 	}
 	if(digits==3 || flag==1)
 	{
-		temp = value/100;
-		hundred = temp%10 + 48;
-		lcd_wr_char(hundred);
+		lcd_put_char((value/100)%10 + 48);
 		flag=1;
 	}
 	if(digits==2 || flag==1)
 	{
-		temp = value/10;
-		tens = temp%10 + 48;
-		lcd_wr_char(tens);
+		lcd_put_char((value/10)%10 + 48);
 		flag=1;
 	}
 	if(digits==1 || flag==1)
 	{
-		unit = value%10 + 48;
-		lcd_wr_char(unit);
+		lcd_put_char(value%10 + 48);
 	}
 	if(digits>5)
 	{
-		lcd_wr_char('E');
+		lcd_put_char('E');
 	}
-	
+
 }
 
 
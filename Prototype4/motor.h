@@ -0,0 +1,98 @@
+/*
+Motor driver.
+
+The two motors are driven by the L293D through the direction bits on PORTA and the enable pins
+PL3 (OC5A, left) and PL4 (OC5B, right), which carry the PWM of TIMER5 (see hal_motor_init):
+
+    resolution = MOTOR_DUTY_MAX + 1 = 1024 steps
+    frequency  = 14745600 / (2 * 1023) = 7.2 kHz
+
+Only the main loop sets the duties, so the 16 bit compare registers need no locking.
+
+motor_set takes a signed duty per wheel: the sign selects the direction bits and the magnitude the
+duty. motor_duty only changes the duty, for the motion functions that set the direction themselves.
+
+Trim: the two motors of a bot are never quite equal. Each duty is scaled by the trim of its wheel
+(Q8, MOTOR_TRIM_ONE = 1.0, down to MOTOR_TRIM_MIN) before it reaches the timer. The trims are kept in
+EEPROM, so they survive a reset; erased EEPROM reads as 0xFFFF, which is taken as no trim.
+*/
+
+#define MOTOR_DUTY_MAX		HAL_MOTOR_TOP
+#define MOTOR_TRIM_ONE		256
+#define MOTOR_TRIM_MIN		128
+
+#define MOTOR_LEFT_BACK		0x01			// PA0
+#define MOTOR_LEFT_FORWARD	0x02			// PA1
+#define MOTOR_RIGHT_FORWARD	0x04			// PA2
+#define MOTOR_RIGHT_BACK	0x08			// PA3
+
+unsigned int motor_trim_eeprom[2] HAL_EEPROM;
+unsigned int motor_trim[2] = {MOTOR_TRIM_ONE, MOTOR_TRIM_ONE};		// Left, right
+
+
+// Function to check a trim value
+unsigned char motor_trim_valid(unsigned int trim)
+{
+	return trim >= MOTOR_TRIM_MIN && trim <= MOTOR_TRIM_ONE;
+}
+
+
+// Function to set up the motor pins and TIMER5 and load the trims
+void motor_init()
+{
+	unsigned char wheel;
+	unsigned int trim;
+
+	hal_motor_init();
+
+	for(wheel = 0; wheel < 2; wheel++)
+	{
+		trim = hal_eeprom_read_word(&motor_trim_eeprom[wheel]);
+		motor_trim[wheel] = motor_trim_valid(trim) ? trim : MOTOR_TRIM_ONE;
+	}
+}
+
+
+// Function to set the duty (0 .. MOTOR_DUTY_MAX) of both wheels, trimmed
+void motor_duty(unsigned int left, unsigned int right)
+{
+	if(left > MOTOR_DUTY_MAX)
+		left = MOTOR_DUTY_MAX;
+	if(right > MOTOR_DUTY_MAX)
+		right = MOTOR_DUTY_MAX;
+
+	hal_motor_duty(((unsigned long)left * motor_trim[0]) >> 8, ((unsigned long)right * motor_trim[1]) >> 8);
+}
+
+
+// Function to drive each wheel with a signed duty, -MOTOR_DUTY_MAX (backward) .. MOTOR_DUTY_MAX (forward)
+void motor_set(int left, int right)
+{
+	unsigned char direction = 0;
+
+	if(left > 0)
+		direction |= MOTOR_LEFT_FORWARD;
+	else if(left < 0)
+		direction |= MOTOR_LEFT_BACK;
+	if(right > 0)
+		direction |= MOTOR_RIGHT_FORWARD;
+	else if(right < 0)
+		direction |= MOTOR_RIGHT_BACK;
+
+	motor_duty((left < 0) ? -left : left, (right < 0) ? -right : right);
+	hal_motor_direction(direction);	// One write, the encoder interrupts may clear it at any time
+}
+
+
+// Function to change the trims and keep them in EEPROM, returns 0 if a trim is out of range
+unsigned char motor_set_trim(unsigned int left, unsigned int right)
+{
+	if(!motor_trim_valid(left) || !motor_trim_valid(right))
+		return 0;
+
+	motor_trim[0] = left;
+	motor_trim[1] = right;
+	hal_eeprom_update_word(&motor_trim_eeprom[0], left);	// Only written if changed, to spare the EEPROM
+	hal_eeprom_update_word(&motor_trim_eeprom[1], right);
+	return 1;
+}
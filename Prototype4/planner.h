@@ -0,0 +1,383 @@
+/*
+Grid path planner.
+
+A* search over the occupancy grid (see grid.h) for the shortest route between two points that keeps
+clear of the obstacles seen so far. The planner works on cells of PLAN_CELL_CM, 2 x 2 cells of the
+map, so its tree takes 1 byte for each of the PLAN_SIZE x PLAN_SIZE cells. A planner cell is blocked
+when any map cell within PLAN_MARGIN map cells of it is occupied, which keeps the route half a bot
+away from the obstacles.
+
+The search runs from the goal towards the bot, so when the bot is reached each cell of the tree
+points the way home: plan_tree holds, for every cell taken off the open list, the direction to its
+parent (PLAN_ROOT for the goal), and the route is read off it from any cell it contains, as long as
+the tree is kept.
+
+Memory and time are bounded:
+open list - PLAN_OPEN entries in a binary heap, 7 bytes each. A cell is in it once (PLAN_OPENED in
+            plan_tree); reaching it again on a shorter way updates its entry. The heap is sized for
+            the frontier of a search across the whole grid round a wall (about 100 cells), so it only
+            fills in a maze; then a new entry replaces the worst leaf, whose cell can be reached
+            again later, or is dropped if it is worse itself.
+work      - plan_step expands at most the number of cells it is asked for, so the search is spread
+            over as many scheduler runs as it needs.
+
+Moves go to the 8 neighbours, 10 straight and 14 diagonally; the heuristic is the octile distance.
+The tree bends in steps of 45 degrees, so plan_next smooths the route as it reads it: a corner is left
+out as long as the straight line from the last corner to the cell after it only crosses free cells
+(see plan_visible).
+*/
+
+#define PLAN_SCALE			2									// Map cells per planner cell and side
+#define PLAN_SIZE			(GRID_SIZE / PLAN_SCALE)
+#define PLAN_CELL_CM		(GRID_CELL_CM * PLAN_SCALE)
+#define PLAN_MARGIN			1									// Map cells around a planner cell that must be free
+#define PLAN_OPEN			128
+#define PLAN_SMOOTH_CELLS	24									// Cells of the tree plan_next looks along for one corner
+#define PLAN_STRAIGHT		10
+#define PLAN_DIAGONAL		14
+
+#define PLAN_ROOT			8									// plan_tree: the goal
+#define PLAN_CLEAR			0xFC								// plan_tree: not in the tree, found free by plan_free
+#define PLAN_OPENED			0xFD								// plan_tree: on the open list
+#define PLAN_BLOCKED		0xFE								// plan_tree: found blocked
+#define PLAN_UNSEEN			0xFF								// plan_tree: not reached yet
+
+#define PLAN_SEARCHING		0
+#define PLAN_FOUND			1
+#define PLAN_NO_ROUTE		2
+
+typedef struct
+{
+	unsigned char x, y;
+	unsigned char parent;						// Direction from the cell to the one it was reached from
+	unsigned int g;								// Cost from the goal
+	unsigned int f;								// g + estimate to the bot
+} plan_entry;
+
+const signed char plan_dx[8] = {0, 1, 1, 1, 0, -1, -1, -1};		// Clockwise from +y, like the heading
+const signed char plan_dy[8] = {1, 1, 0, -1, -1, -1, 0, 1};
+
+unsigned char plan_tree[PLAN_SIZE * PLAN_SIZE];
+plan_entry plan_open[PLAN_OPEN];
+unsigned char plan_open_count = 0;
+unsigned char plan_target_x, plan_target_y;		// Cell of the bot, where the search ends
+unsigned char plan_walk_x, plan_walk_y;			// Cell the route has been read up to
+long plan_goal_x, plan_goal_y;					// 1/256 cm
+
+
+// Function to return the planner cell of a coordinate in 1/256 cm, GRID_OUTSIDE if off the grid
+int plan_cell(long q8)
+{
+	int cell = grid_cell(q8);
+
+	return (cell == GRID_OUTSIDE) ? GRID_OUTSIDE : cell / PLAN_SCALE;
+}
+
+
+// Function to return the centre of a planner cell in 1/256 cm
+long plan_centre(unsigned char cell)
+{
+	return CM_TO_Q8(((int)cell - PLAN_SIZE / 2) * PLAN_CELL_CM + PLAN_CELL_CM / 2);
+}
+
+
+// Function to tell whether a planner cell is too close to an occupied map cell
+unsigned char plan_blocked(unsigned char px, unsigned char py)
+{
+	int x, y, first_x, first_y;
+
+	first_x = px * PLAN_SCALE - PLAN_MARGIN;
+	first_y = py * PLAN_SCALE - PLAN_MARGIN;
+	for(y = first_y; y < first_y + PLAN_SCALE + 2 * PLAN_MARGIN; y++)
+	{
+		if(y < 0 || y >= GRID_SIZE)
+			continue;
+		for(x = first_x; x < first_x + PLAN_SCALE + 2 * PLAN_MARGIN; x++)
+			if(x >= 0 && x < GRID_SIZE && grid_occupied(x, y))
+				return 1;
+	}
+	return 0;
+}
+
+
+// Function to return the octile distance from a cell to the bot
+unsigned int plan_estimate(unsigned char x, unsigned char y)
+{
+	unsigned char dx = (x > plan_target_x) ? x - plan_target_x : plan_target_x - x;
+	unsigned char dy = (y > plan_target_y) ? y - plan_target_y : plan_target_y - y;
+
+	return (dx > dy) ? PLAN_STRAIGHT * dx + (PLAN_DIAGONAL - PLAN_STRAIGHT) * dy
+					 : PLAN_STRAIGHT * dy + (PLAN_DIAGONAL - PLAN_STRAIGHT) * dx;
+}
+
+
+// Function to tell whether an open list entry is to be expanded before another: lower f, then higher g
+unsigned char plan_before(const plan_entry *a, const plan_entry *b)
+{
+	return a->f < b->f || (a->f == b->f && a->g > b->g);
+}
+
+
+/*
+Function to put a cell on the open list, or to update its entry if the cell is reached on a shorter way.
+When the list is full the worst leaf makes room.
+*/
+void plan_push(unsigned char x, unsigned char y, unsigned char parent, unsigned int g)
+{
+	unsigned char i, worst;
+	plan_entry entry;
+
+	entry.x = x;
+	entry.y = y;
+	entry.parent = parent;
+	entry.g = g;
+	entry.f = g + plan_estimate(x, y);
+
+	if(plan_tree[y * PLAN_SIZE + x] == PLAN_OPENED)
+	{
+		for(i = 0; plan_open[i].x != x || plan_open[i].y != y; i++);
+		if(g >= plan_open[i].g)
+			return;
+	}
+	else if(plan_open_count < PLAN_OPEN)
+		i = plan_open_count++;
+	else
+	{
+		worst = PLAN_OPEN / 2;							// The worst entry is one of the leaves
+		for(i = worst + 1; i < PLAN_OPEN; i++)
+			if(plan_before(&plan_open[worst], &plan_open[i]))
+				worst = i;
+		if(!plan_before(&entry, &plan_open[worst]))
+			return;
+		i = worst;
+		plan_tree[plan_open[i].y * PLAN_SIZE + plan_open[i].x] = PLAN_UNSEEN;
+	}
+	plan_tree[y * PLAN_SIZE + x] = PLAN_OPENED;
+
+	while(i && plan_before(&entry, &plan_open[(i - 1) / 2]))		// Up past the worse parents
+	{
+		plan_open[i] = plan_open[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	plan_open[i] = entry;
+}
+
+
+// Function to take the best entry off the open list into "entry"
+void plan_pop(plan_entry *entry)
+{
+	unsigned char i = 0, child;
+	plan_entry last;
+
+	*entry = plan_open[0];
+	last = plan_open[--plan_open_count];
+	while((child = 2 * i + 1) < plan_open_count)				// Down past the better children
+	{
+		if(child + 1 < plan_open_count && plan_before(&plan_open[child + 1], &plan_open[child]))
+			child++;
+		if(!plan_before(&plan_open[child], &last))
+			break;
+		plan_open[i] = plan_open[child];
+		i = child;
+	}
+	plan_open[i] = last;
+}
+
+
+/*
+Function to start a search for the route from (from_x, from_y) to (goal_x, goal_y), in 1/256 cm.
+Returns 0 if either point is off the grid, or both are in the same cell and the way is straight.
+*/
+unsigned char plan_begin(long from_x, long from_y, long goal_x, long goal_y)
+{
+	int fx = plan_cell(from_x), fy = plan_cell(from_y);
+	int gx = plan_cell(goal_x), gy = plan_cell(goal_y);
+	unsigned int i;
+
+	if(fx == GRID_OUTSIDE || fy == GRID_OUTSIDE || gx == GRID_OUTSIDE || gy == GRID_OUTSIDE || (fx == gx && fy == gy))
+		return 0;
+
+	for(i = 0; i < PLAN_SIZE * PLAN_SIZE; i++)
+		plan_tree[i] = PLAN_UNSEEN;
+
+	plan_target_x = fx;
+	plan_target_y = fy;
+	plan_goal_x = goal_x;
+	plan_goal_y = goal_y;
+	plan_open_count = 0;
+	plan_push(gx, gy, PLAN_ROOT, 0);
+	return 1;
+}
+
+
+/*
+Function to expand up to "expansions" cells of the search.
+Returns PLAN_FOUND when the bot's cell is reached, PLAN_NO_ROUTE when the open list runs out.
+*/
+unsigned char plan_step(unsigned char expansions)
+{
+	unsigned char direction, x, y, tree;
+	int nx, ny;
+	plan_entry cell;
+
+	while(expansions--)
+	{
+		if(!plan_open_count)
+			return PLAN_NO_ROUTE;
+
+		plan_pop(&cell);
+
+		x = cell.x;
+		y = cell.y;
+		if(cell.parent != PLAN_ROOT && !(x == plan_target_x && y == plan_target_y) && plan_blocked(x, y))
+		{
+			plan_tree[y * PLAN_SIZE + x] = PLAN_BLOCKED;
+			continue;
+		}
+
+		plan_tree[y * PLAN_SIZE + x] = cell.parent;
+		if(x == plan_target_x && y == plan_target_y)
+		{
+			plan_walk_x = x;
+			plan_walk_y = y;
+			return PLAN_FOUND;
+		}
+
+		for(direction = 0; direction < 8; direction++)
+		{
+			nx = x + plan_dx[direction];
+			ny = y + plan_dy[direction];
+			if(nx < 0 || nx >= PLAN_SIZE || ny < 0 || ny >= PLAN_SIZE)
+				continue;
+			tree = plan_tree[ny * PLAN_SIZE + nx];
+			if(tree <= PLAN_ROOT || tree == PLAN_BLOCKED)
+				continue;							// Closed, or blocked
+			plan_push(nx, ny, (direction + 4) & 7, cell.g + ((direction & 1) ? PLAN_DIAGONAL : PLAN_STRAIGHT));
+		}
+	}
+	return PLAN_SEARCHING;
+}
+
+
+/*
+Function to tell whether a planner cell is free: closed by the search, or checked against the map now.
+Only called once the search is over; the answer is kept in plan_tree, so a cell is checked once.
+*/
+unsigned char plan_free(unsigned char x, unsigned char y)
+{
+	unsigned char tree = plan_tree[y * PLAN_SIZE + x];
+
+	if(tree == PLAN_UNSEEN || tree == PLAN_OPENED)
+	{
+		tree = plan_blocked(x, y) ? PLAN_BLOCKED : PLAN_CLEAR;
+		plan_tree[y * PLAN_SIZE + x] = tree;
+	}
+	return tree != PLAN_BLOCKED;
+}
+
+
+/*
+Function to tell whether the straight line between the centres of two cells only crosses free cells.
+The line is walked cell by cell; where it passes exactly through the corner of four cells, both cells
+beside the corner are checked as well, so the bot does not cut it.
+*/
+unsigned char plan_visible(unsigned char x1, unsigned char y1, unsigned char x2, unsigned char y2)
+{
+	int dx = (x2 > x1) ? x2 - x1 : x1 - x2, dy = (y2 > y1) ? y2 - y1 : y1 - y2;
+	signed char sx = (x2 > x1) ? 1 : -1, sy = (y2 > y1) ? 1 : -1;
+	int error = dx - dy, moves = dx + dy;
+
+	while(moves > 0)
+	{
+		if(error > 0)
+		{
+			x1 += sx;
+			error -= 2 * dy;
+			moves--;
+		}
+		else if(error < 0)
+		{
+			y1 += sy;
+			error += 2 * dx;
+			moves--;
+		}
+		else
+		{
+			if(!plan_free(x1 + sx, y1) || !plan_free(x1, y1 + sy))
+				return 0;
+			x1 += sx;
+			y1 += sy;
+			error += 2 * (dx - dy);
+			moves -= 2;
+		}
+		if(!plan_free(x1, y1))
+			return 0;
+	}
+	return 1;
+}
+
+
+/*
+Function to read the next corner of the route after the last one read (the first call starts from the
+bot's cell), in 1/256 cm; the last point is the goal itself. Returns 0 when the goal has been read.
+The route is followed along the tree for as long as the cells stay in sight of the last corner, up to
+PLAN_SMOOTH_CELLS cells, and the last cell in sight is the next corner.
+*/
+unsigned char plan_next(long *x, long *y)
+{
+	unsigned char direction = plan_tree[plan_walk_y * PLAN_SIZE + plan_walk_x];
+	unsigned char cx = plan_walk_x, cy = plan_walk_y, nx, ny, cells = 0;
+
+	if(direction == PLAN_ROOT)
+		return 0;
+
+	do
+	{
+		nx = cx + plan_dx[direction];
+		ny = cy + plan_dy[direction];
+		if(cells && !plan_visible(plan_walk_x, plan_walk_y, nx, ny))
+			break;								// The corner before it is as far as the line goes
+		cx = nx;
+		cy = ny;
+		direction = plan_tree[cy * PLAN_SIZE + cx];
+	} while(direction != PLAN_ROOT && ++cells < PLAN_SMOOTH_CELLS);
+
+	plan_walk_x = cx;
+	plan_walk_y = cy;
+	if(direction == PLAN_ROOT)
+	{
+		*x = plan_goal_x;
+		*y = plan_goal_y;
+	}
+	else
+	{
+		*x = plan_centre(plan_walk_x);
+		*y = plan_centre(plan_walk_y);
+	}
+	return 1;
+}
+
+
+/*
+Function to check the next "cells" cells of the route from the point (x, y) in 1/256 cm against the map.
+Returns 0 if one of them has become blocked. A point off the route (not in the tree) is not checked.
+*/
+unsigned char plan_route_clear(long x, long y, unsigned char cells)
+{
+	int cx = plan_cell(x), cy = plan_cell(y);
+	unsigned char direction;
+
+	if(cx == GRID_OUTSIDE || cy == GRID_OUTSIDE)
+		return 1;
+
+	direction = plan_tree[cy * PLAN_SIZE + cx];
+	while(cells-- && direction < PLAN_ROOT)
+	{
+		cx += plan_dx[direction];
+		cy += plan_dy[direction];
+		direction = plan_tree[cy * PLAN_SIZE + cx];
+		if(direction != PLAN_ROOT && plan_blocked(cx, cy))
+			return 0;
+	}
+	return 1;
+}
@@ -0,0 +1,82 @@
+/*
+Trapezoidal speed profile.
+
+A motion that knows how far it has to go (the stop target of the encoder interrupts) does not jump
+to its cruise speed and stop dead: profile_next is called once per speed control period with the
+counts left to the target and returns the speed to command for that period.
+
+accelerate - the speed rises by "accel" per period from "creep" up to "cruise"
+cruise     - the speed stays at "cruise"
+decelerate - the speed is held below sqrt(2 * a * remaining), the speed from which the same
+             acceleration a brings the wheel to rest exactly at the target
+
+A short motion never reaches cruise and its profile is a triangle. The speed never drops below
+"creep", so the wheels always get to the target, where the encoder interrupts stop the motors.
+All speeds are in shaft encoder counts per second, like the speed controllers.
+*/
+
+typedef struct
+{
+	int cruise;					// Top speed
+	int creep;					// Lowest speed, at the start and at the target
+	int accel;					// Speed change per period
+	long brake;					// 2 * a in counts/s^2, for the deceleration limit
+	int speed;					// Speed returned by the last profile_next
+} speed_profile;
+
+
+// Function to return the integer square root of "value"
+unsigned int isqrt(unsigned long value)
+{
+	unsigned long root = 0, bit = 1UL << 30;
+
+	while(bit > value)
+		bit >>= 2;
+	while(bit)
+	{
+		if(value >= root + bit)
+		{
+			value -= root + bit;
+			root = (root >> 1) + bit;
+		}
+		else
+			root >>= 1;
+		bit >>= 2;
+	}
+	return root;
+}
+
+
+// Function to start a profile from rest; "accel" is in counts/s^2 and "rate" is the number of periods per second
+void profile_start(speed_profile *profile, int cruise, int creep, int accel, unsigned char rate)
+{
+	profile->cruise = cruise;
+	profile->creep = (creep < cruise) ? creep : cruise;
+	profile->accel = accel / rate;
+	if(profile->accel == 0)
+		profile->accel = 1;
+	profile->brake = 2L * accel;
+	profile->speed = profile->creep;
+}
+
+
+// Function to return the speed for the next period with "remaining" counts left to the target
+int profile_next(speed_profile *profile, int remaining)
+{
+	unsigned int limit;
+
+	if(remaining < 0)
+		remaining = 0;
+
+	profile->speed += profile->accel;
+	if(profile->speed > profile->cruise)
+		profile->speed = profile->cruise;
+
+	limit = isqrt(profile->brake * remaining);
+	if(limit < profile->creep)
+		limit = profile->creep;
+	if(profile->speed > (int)limit)
+		profile->speed = limit;
+
+	return profile->speed;
+}
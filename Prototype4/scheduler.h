@@ -0,0 +1,170 @@
+/*
+Cooperative scheduler.
+
+The TIMER2 interrupt calls sched_tick 1024 times a second. Every task has a release period in ticks;
+when it elapses the task is marked pending, and sched_run (called from main() and from every loop
+that waits for a motion to finish) runs the pending tasks in table order, so earlier entries have
+priority. Tasks run to completion and must not block.
+
+Per task statistics:
+late     - the task was released again while the previous release had not run yet (missed deadline)
+overruns - a run took longer than the task's budget
+worst    - longest run time seen
+Run times are measured on TIMER1 (4.34 us per count); a budget of SCHED_NO_BUDGET is not checked.
+The PC reads them with the QUERY_TASKS command (see tasks_send in Prototype4.c), which clears them.
+*/
+
+#define SCHED_TICK_HZ 1024
+#define SCHED_TICK_COUNTS HAL_TICK_COUNTS					// TIMER1 counts per tick
+#define MS_TO_TICKS(ms) ((unsigned int)(((ms) * 128UL) / 125))	// 1024 / 1000 = 128 / 125
+
+#define TASK_OFF 0
+#define SCHED_NO_BUDGET 0xFFFF
+
+typedef struct
+{
+	void (*run)(void);
+	unsigned char period;				// Release period in ticks, TASK_OFF disables the task
+	unsigned int budget;				// Longest allowed run time in TIMER1 counts
+	volatile unsigned char countdown;	// Ticks left until the next release
+	volatile unsigned char pending;		// Set when released, cleared when the task starts
+	volatile unsigned char late;
+	unsigned char overruns;
+	unsigned int worst;
+} sched_task;
+
+extern sched_task sched_tasks[];
+extern const unsigned char sched_task_count;
+
+volatile unsigned int sched_ticks = 0;
+unsigned int loop_last_stamp = 0;
+unsigned int loop_period = 0, loop_period_max = 0;	// Time between two calls of sched_run, in TIMER1 counts
+
+
+void sched_init()
+{
+	unsigned char i;
+
+	for(i = 0; i < sched_task_count; i++)
+	{
+		sched_tasks[i].countdown = sched_tasks[i].period;
+		sched_tasks[i].pending = 0;
+	}
+	hal_sleep_init();
+}
+
+
+// Function called from the tick interrupt to release the tasks that are due
+void sched_tick()
+{
+	unsigned char i;
+	sched_task *task;
+
+	sched_ticks++;
+
+	for(i = 0; i < sched_task_count; i++)
+	{
+		task = &sched_tasks[i];
+		if(task->period == TASK_OFF)
+			continue;
+		if(--task->countdown)
+			continue;
+
+		task->countdown = task->period;
+		if(task->pending && task->late != 0xFF)
+			task->late++;
+		task->pending = 1;
+	}
+}
+
+
+// Function to return the tick counter; it is 16 bit wide, so it is read again if the tick interrupt changed it
+unsigned int sched_now()
+{
+	unsigned int ticks;
+
+	do
+		ticks = sched_ticks;
+	while(ticks != sched_ticks);
+	return ticks;
+}
+
+
+// Function to change the period of a task, TASK_OFF stops it
+void sched_set_period(unsigned char index, unsigned char period)
+{
+	unsigned char interrupts = hal_irq_save();
+
+	sched_tasks[index].period = period;
+	sched_tasks[index].countdown = period;
+	sched_tasks[index].pending = 0;
+	hal_irq_restore(interrupts);
+}
+
+
+// Function to run every pending task once, in priority order
+void sched_run()
+{
+	unsigned char i;
+	unsigned int start, time;
+	sched_task *task;
+
+	start = hal_timer_now();
+	loop_period = start - loop_last_stamp;
+	loop_last_stamp = start;
+	if(loop_period > loop_period_max)
+		loop_period_max = loop_period;
+
+	for(i = 0; i < sched_task_count; i++)
+	{
+		task = &sched_tasks[i];
+		if(!task->pending)
+			continue;
+		task->pending = 0;
+
+		start = hal_timer_now();
+		task->run();
+		time = hal_timer_now() - start;
+
+		if(time > task->worst)
+			task->worst = time;
+		if(time > task->budget && task->overruns != 0xFF)
+			task->overruns++;
+	}
+}
+
+
+// Function to sleep until the next interrupt if no task is pending
+void sched_idle()
+{
+	unsigned char i;
+
+	hal_irq_disable();
+	for(i = 0; i < sched_task_count; i++)
+	{
+		if(sched_tasks[i].pending)
+		{
+			hal_irq_enable();
+			return;
+		}
+	}
+	hal_sleep();				// Enables the interrupts without losing a wake up
+}
+
+
+// Function to let the tasks run while a caller waits for something to happen
+void sched_yield()
+{
+	sched_run();
+	sched_idle();
+}
+
+
+// Function to wait for a number of ticks while the tasks keep running
+void sched_wait(unsigned int ticks)
+{
+	unsigned int start = sched_now();
+
+	while(sched_now() - start < ticks)
+		sched_yield();
+}
@@ -0,0 +1,51 @@
+/*
+Sequence counters for data shared with the interrupts.
+
+An interrupt that updates a group of multi-byte variables increments the group's sequence
+before and after the update, so the sequence is odd while the update is in progress.
+A reader copies the group between seq_read_begin and seq_read_retry and copies it again if
+the sequence moved, which means an interrupt wrote the group in the meantime:
+
+	do
+	{
+		start = seq_read_begin(&sequence);
+		... copy the variables ...
+	} while(seq_read_retry(&sequence, start));
+
+Readers never disable the interrupts, so the encoder edges and the odometry are never held
+up by the main loop, however often it reads. An interrupt takes a few microseconds, so a
+retry is rare and a reader loops at most once per interrupt.
+*/
+
+typedef volatile unsigned char seqlock;
+
+#define seq_barrier()			__asm__ __volatile__ ("" ::: "memory")	// Keeps the compiler from moving the copy out of the loop
+
+
+// Function called by the writer before and after it updates the group
+void seq_write(seqlock *sequence)
+{
+	seq_barrier();
+	(*sequence)++;
+	seq_barrier();
+}
+
+
+// Function to start a read, returns the sequence the copy belongs to
+unsigned char seq_read_begin(seqlock *sequence)
+{
+	unsigned char start;
+
+	while((start = *sequence) & 1)
+		;
+	seq_barrier();
+	return start;
+}
+
+
+// Function to end a read, returns 1 if the copy is torn and must be taken again
+unsigned char seq_read_retry(seqlock *sequence, unsigned char start)
+{
+	seq_barrier();
+	return *sequence != start;
+}
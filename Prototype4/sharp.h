@@ -0,0 +1,45 @@
+/*
+Distance lookup tables for the Sharp IR range sensors.
+
+The calibrated curve of a sensor is  distance(mm) = 10 * scale / reading^exponent.
+Evaluating it with pow() in soft-float costs thousands of cycles per sample, and the ADC only
+gives 8-bit readings, so the whole curve is tabulated for the 256 possible readings.
+SHARP_TABLE expands to the 256 initialisers; every entry is a constant expression that the
+compiler folds while building, so the table is generated at build time and lives in flash.
+A reading of 0 means nothing is in range and is mapped to SHARP_NO_OBSTACLE.
+*/
+
+#define SHARP_SENSORS 5
+#define SHARP_NO_OBSTACLE 0xFFFF
+
+#define SHARP_DIST(r,k,e)	((r) ? (unsigned int)(10.0*(k)/pow((double)(r),(e))) : SHARP_NO_OBSTACLE)
+
+#define SHARP_ROW4(r,k,e)	SHARP_DIST(r,k,e), SHARP_DIST(r+1,k,e), SHARP_DIST(r+2,k,e), SHARP_DIST(r+3,k,e)
+#define SHARP_ROW16(r,k,e)	SHARP_ROW4(r,k,e), SHARP_ROW4(r+4,k,e), SHARP_ROW4(r+8,k,e), SHARP_ROW4(r+12,k,e)
+#define SHARP_ROW64(r,k,e)	SHARP_ROW16(r,k,e), SHARP_ROW16(r+16,k,e), SHARP_ROW16(r+32,k,e), SHARP_ROW16(r+48,k,e)
+#define SHARP_TABLE(k,e)	{ SHARP_ROW64(0,k,e), SHARP_ROW64(64,k,e), SHARP_ROW64(128,k,e), SHARP_ROW64(192,k,e) }
+
+
+/*
+Calibration curves.
+All the sensors use the curve measured for the front sensor (ADC channel 11) until they are
+calibrated individually; a new curve is added as another table and pointed at in sharp_table.
+*/
+const unsigned int sharp_curve_default[256] HAL_FLASH = SHARP_TABLE(2799.6, 1.1546);
+
+// Table used by each Sharp sensor, sensor 1 (ADC channel 9) to sensor 5 (ADC channel 13)
+const unsigned int *const sharp_table[SHARP_SENSORS] =
+{
+	sharp_curve_default,
+	sharp_curve_default,
+	sharp_curve_default,
+	sharp_curve_default,
+	sharp_curve_default
+};
+
+
+// Function to convert the reading of Sharp sensor 1..5 to a distance in mm
+unsigned int sharp_distance(unsigned char sensor, unsigned char reading)
+{
+	return hal_flash_word(&sharp_table[sensor - 1][reading]);
+}
@@ -0,0 +1,8 @@
+/*
+The firmware, built for the host simulator: Prototype4.c unchanged, on the host backend of the HAL
+(see hal_host.h), with main renamed so the simulator can start it (see sim.c).
+*/
+
+#define HAL_HOST
+#define main firmware_main
+#include "../Prototype4.c"
@@ -0,0 +1,160 @@
+/*
+Host test of the route planner (see planner.h).
+
+Each case maps a few walls into the occupancy grid, searches the route from a start point to a goal the
+way plan_task does, PLAN_EXPANSIONS cells at a time, and reads the corners off with plan_next. A case
+fails when no route is found, when the bot would touch a mapped wall on a leg of the route (a circle of
+TEST_RADIUS round its centre), or when the route is longer than the shortest way round the walls plus a
+margin.
+
+    gcc -O2 -std=gnu99 -funsigned-char sim/plan_test.c -lm -o plan-test
+    ./plan-test [-v]
+
+-v prints the corners of every route. The exit status is 1 if a case failed.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#define HAL_HOST
+#include "../hal.h"
+#include "../heading.h"
+#include "../field.h"
+#include "../grid.h"
+#include "../planner.h"
+
+#define TEST_EXPANSIONS     4               // As plan_task
+#define TEST_STEPS          4000            // Runs of plan_step before the search is given up
+#define TEST_CORNERS        64
+#define TEST_RADIUS         8.0             // cm, the bot
+
+// The hardware of the HAL (see hal_host.h), not used by the planner
+volatile unsigned char hal_host_interrupts, hal_host_timers, hal_host_direction, hal_host_encoders;
+volatile unsigned int hal_host_clock, hal_host_duty[2];
+volatile unsigned char hal_host_adc_channel, hal_host_adc_busy, hal_host_adc_result;
+volatile unsigned char hal_host_uart_enabled, hal_host_uart_ubrr, hal_host_uart_data, hal_host_uart_tx;
+
+void hal_host_sleep(void) {}
+void hal_host_delay_us(double us) {}
+void hal_host_uart_send(unsigned char data) {}
+
+int test_verbose = 0;
+
+// Function to map a wall from (x1,y1) to (x2,y2) in cm as occupied cells
+void test_wall(double x1, double y1, double x2, double y2)
+{
+    double length = hypot(x2 - x1, y2 - y1), t;
+    int cx, cy;
+
+    for(t = 0; t <= length; t += 1.0)
+    {
+        cx = grid_cell(CM_TO_Q8(x1 + (x2 - x1) * t / length));
+        cy = grid_cell(CM_TO_Q8(y1 + (y2 - y1) * t / length));
+        if(cx == GRID_OUTSIDE || cy == GRID_OUTSIDE)
+            continue;
+        while(!grid_occupied(cx, cy))
+            grid_mark(cx, cy, 1);
+    }
+}
+
+// Function to tell whether the bot, centred on (x,y) in cm, touches an occupied map cell
+int test_touches(double x, double y)
+{
+    double angle;
+    int cx, cy;
+
+    for(angle = 0; angle < 2 * M_PI; angle += M_PI / 8)
+    {
+        cx = grid_cell(CM_TO_Q8(floor(x + TEST_RADIUS * sin(angle))));
+        cy = grid_cell(CM_TO_Q8(floor(y + TEST_RADIUS * cos(angle))));
+        if(cx != GRID_OUTSIDE && cy != GRID_OUTSIDE && grid_occupied(cx, cy))
+            return 1;
+    }
+    return 0;
+}
+
+// Function to tell whether the bot can drive the leg from (x1,y1) to (x2,y2) in cm without touching a wall
+int test_leg_clear(double x1, double y1, double x2, double y2)
+{
+    double length = hypot(x2 - x1, y2 - y1), t;
+
+    for(t = 0; t <= length; t += 1.0)
+        if(test_touches(x1 + (x2 - x1) * t / length, y1 + (y2 - y1) * t / length))
+            return 0;
+    return 1;
+}
+
+// Function to plan from (x,y) to (goal_x,goal_y) in cm and check the route, returns 1 if the case passed
+int test_route(const char *name, double x, double y, double goal_x, double goal_y, double longest)
+{
+    long corner_x, corner_y;
+    double from_x = x, from_y = y, length = 0, to_x, to_y;
+    int steps = 0, corners = 0, clear = 1;
+    unsigned char result = PLAN_SEARCHING;
+
+    if(!plan_begin(CM_TO_Q8(x), CM_TO_Q8(y), CM_TO_Q8(goal_x), CM_TO_Q8(goal_y)))
+    {
+        printf("%s: not planned\n", name);
+        return 0;
+    }
+    while(result == PLAN_SEARCHING && steps++ < TEST_STEPS)
+        result = plan_step(TEST_EXPANSIONS);
+    if(result != PLAN_FOUND)
+    {
+        printf("%s: no route after %d runs\n", name, steps);
+        return 0;
+    }
+
+    while(corners < TEST_CORNERS && plan_next(&corner_x, &corner_y))
+    {
+        to_x = corner_x / 256.0;
+        to_y = corner_y / 256.0;
+        if(test_verbose)
+            printf("%s: (%.0f,%.0f)\n", name, to_x, to_y);
+        if(!test_leg_clear(from_x, from_y, to_x, to_y))
+            clear = 0;
+        length += hypot(to_x - from_x, to_y - from_y);
+        from_x = to_x;
+        from_y = to_y;
+        corners++;
+    }
+
+    printf("%s: %d corners, %.0f cm, at most %.0f cm, %s, %d runs\n", name, corners, length, longest,
+           clear ? "clear" : "touching a wall", steps);
+    return clear && length <= longest && from_x == goal_x && from_y == goal_y;
+}
+
+int main(int argc, char **argv)
+{
+    int failed = 0;
+
+    if(argc > 1 && !strcmp(argv[1], "-v"))
+        test_verbose = 1;
+
+    // A long wall between the bot and home, open at the east end only: about 620 cm round it
+    grid_clear();
+    test_wall(-310, 75, 250, 75);
+    if(!test_route("long wall", 0, 150, 0, 0, 660))
+        failed = 1;
+
+    // The same wall, from the other side
+    if(!test_route("long wall back", 0, 0, 0, 150, 660))
+        failed = 1;
+
+    // A box in the way, 100 cm wide: a short detour
+    grid_clear();
+    test_wall(-50, 60, 50, 60);
+    test_wall(50, 60, 50, 90);
+    test_wall(50, 90, -50, 90);
+    test_wall(-50, 90, -50, 60);
+    if(!test_route("box", 0, 160, 0, 0, 250))
+        failed = 1;
+
+    // Nothing in the way: a straight line
+    grid_clear();
+    if(!test_route("open", 120, 150, 0, 0, 193))
+        failed = 1;
+
+    printf(failed ? "FAILED\n" : "passed\n");
+    return failed;
+}
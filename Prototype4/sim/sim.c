@@ -0,0 +1,759 @@
+/*
+Host simulator of the Firebird V running Prototype4.c.
+
+The firmware is built for Linux on the host backend of the HAL (see hal_host.h and firmware.c) and runs
+unchanged. Its time only passes when it sleeps or waits (hal_host_sleep, hal_host_delay_us); then the
+simulator runs the bot and its hardware on in steps of SIM_STEP clock counts and takes the interrupts
+that come due:
+
+motors   - the direction bits give the direction of each wheel and the duties over HAL_MOTOR_TOP the
+           speed. Each wheel goes to duty * SIM_TOP_SPEED, times its own gain, with a time constant of
+           SIM_MOTOR_TAU.
+bot      - differential drive, SIM_WHEEL_BASE between the wheels, a circle of SIM_RADIUS. Against a
+           wall the bot stops while the wheels keep turning, so the odometry is fooled as it would be.
+encoders - an edge on INT4 (left) or INT5 (right) for every SIM_COUNT_CM a wheel turns, with the clock
+           set to the moment of the edge within the step.
+timers   - the scheduler tick (TIMER2_COMPA) every HAL_TICK_COUNTS and the odometry update (TIMER4_COMPA)
+           every HAL_ODOMETRY_COUNTS.
+ADC      - one conversion per step. Sharp sensors 1 to 5 (channels 9 to 13) give the inverse of the
+           curve of sharp.h for the distance to the nearest wall along the sensor; the IR proximity
+           sensors (channels 4 to 8) read SIM_IR_NEAR within SIM_IR_RANGE of a wall.
+UART0    - the mission is received at 9600 baud; what the firmware sends is taken as fast as it comes.
+
+Noise, drawn again for every run: the gain of each motor, the true size of each wheel (what the
+odometry cannot know), slip of the wheels on every step and the noise of the Sharp sensors.
+
+The arena file lists walls in cm; the bot starts at (0,0) heading along +y, as the odometry does:
+
+    wall x1 y1 x2 y2        - a wall from (x1,y1) to (x2,y2)
+    box x1 y1 x2 y2         - the four walls of a rectangle
+
+The mission file lists commands sent one after the other; each one is sent when the bot has been idle
+for SIM_SETTLE after the previous one (no motion, path, avoidance or planning left):
+
+    move x y                - MOVE_TO frame, cm
+    rotate a                - ROTATE_TO frame, degrees
+    stop                    - STOP frame
+    key c [n]               - KEY frame of keyboard key c, n times, each once the previous one is done
+    home                    - KEY frame of key 7, the planned return to (0,0)
+    retrace                 - KEY frame of key 9, the return along the trail
+    wait ms                 - pause
+
+A run ends when the last command has finished, or at the time limit, and reports the mission time
+from the first command, where the bot really is, and how far the odometry is from it.
+Every run is a fork of the simulator, so the firmware starts from its initial state each time.
+
+    gcc -O2 -std=gnu99 -funsigned-char sim/sim.c sim/firmware.c -lm -o firebird-sim
+    ./firebird-sim [-a arena] [-m mission] [-n runs] [-s seed] [-t limit s] [-q] [-v] [-T]
+
+-q turns the noise off, -v prints every run and -T traces every SIM_TRACE_PERIOD of the runs to stderr:
+time, true pose, pose of the firmware, the direction bits, the duties and the state of the motion, avoidance
+and planner.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#define HAL_HOST
+#include "../hal.h"
+
+#define SIM_T1_HZ           ((double)HAL_CLOCK_HZ)
+#define SIM_STEP            16              // Clock counts per step, 69 us
+#define SIM_DT              (SIM_STEP / SIM_T1_HZ)
+#define SIM_BYTE_COUNTS     240             // 10 bits at 9600 baud
+#define SIM_BOOT            0.2             // s before the first command
+
+#define SIM_TOP_SPEED       60.0            // cm/s at full duty
+#define SIM_MOTOR_TAU       0.05            // s
+#define SIM_WHEEL_BASE      15.1            // cm
+#define SIM_RADIUS          8.0             // cm
+#define SIM_COUNT_CM        0.27            // Wheel travel per encoder edge
+#define SIM_SENSOR_RIM      8.0             // cm from the centre to the sensors
+#define SIM_SHARP_MIN       8.0             // cm, closer reads the same
+#define SIM_SHARP_MAX       150.0           // cm, further reads the same
+#define SIM_IR_RANGE        8.0             // cm
+#define SIM_IR_NEAR         40
+#define SIM_IR_FAR          200
+
+#define SIM_GAIN_SIGMA      0.03            // Motor gain
+#define SIM_SCALE_SIGMA     0.01            // Wheel size
+#define SIM_SLIP_SIGMA      0.02            // Slip per step
+#define SIM_SHARP_SIGMA     0.02            // Sharp distance
+
+#define SIM_SETTLE          0.25            // s idle before the next command
+#define SIM_TRACE_PERIOD    0.1             // s
+#define SIM_WALLS           256
+#define SIM_COMMANDS        64
+#define SIM_RX_QUEUE        256
+
+// The hardware of the HAL (see hal_host.h)
+volatile unsigned char hal_host_interrupts, hal_host_timers, hal_host_direction, hal_host_encoders;
+volatile unsigned int hal_host_clock, hal_host_duty[2];
+volatile unsigned char hal_host_adc_channel, hal_host_adc_busy, hal_host_adc_result;
+volatile unsigned char hal_host_uart_enabled, hal_host_uart_ubrr, hal_host_uart_data, hal_host_uart_tx;
+
+// The firmware (firmware.c)
+int firmware_main(void);
+extern unsigned char motion_mode, avoid_state, path_count, plan_mission, command_busy;
+extern volatile unsigned char rx_head, rx_tail;
+extern volatile long current_x, current_y;
+extern volatile int current_theta;
+
+typedef struct
+{
+    double x1, y1, x2, y2;
+} sim_wall;
+
+typedef struct
+{
+    char kind;                              // m, r, s, k, h, t, w
+    double a, b;
+} sim_command;
+
+typedef struct
+{
+    int done;                               // 0 if the run hit the time limit
+    double time;                            // s from the first command
+    double x, y, heading;                   // True pose, cm and degrees
+    double odometry_error;                  // cm between the pose of the firmware and the true one
+    int collisions;
+} sim_result;
+
+sim_wall sim_walls[SIM_WALLS];
+int sim_wall_count = 0;
+sim_command sim_commands[SIM_COMMANDS];
+int sim_command_count = 0;
+int sim_noise = 1;
+double sim_limit = 300.0;
+int sim_result_fd = -1;
+int sim_trace = 0;
+
+// State of one run
+unsigned long long sim_time = 0;            // Clock counts
+double sim_delay_debt = 0;
+int sim_woken = 0;
+double sim_x, sim_y, sim_theta;             // cm, radians clockwise from +y
+double sim_speed[2];                        // Wheel surface speed, cm/s, left and right
+double sim_gain[2], sim_scale[2];
+double sim_travel[2];                       // Encoder edges so far, fractional
+double sim_step_travel[2];                  // Encoder edges of the last step, fractional
+unsigned long sim_edges[2];
+int sim_touching = 0, sim_collisions = 0;
+unsigned long sim_timer2 = 0, sim_timer4 = 0;
+int sim_timer2_pending = 0, sim_timer4_pending = 0, sim_adc_pending = 0;
+unsigned char sim_rx[SIM_RX_QUEUE];
+int sim_rx_head = 0, sim_rx_tail = 0;
+unsigned long long sim_rx_last = 0;
+unsigned char sim_sequence = 0;
+int sim_next = 0;                           // Next mission command
+double sim_started = -1, sim_wait_until = 0, sim_idle_since = -1;
+double sim_traced = 0;
+
+
+double sim_seconds()
+{
+    return sim_time / SIM_T1_HZ;
+}
+
+// Function to return a normally distributed number with the given sigma, 0 without noise
+double sim_gauss(double sigma)
+{
+    double u = drand48(), v = drand48();
+
+    if(!sim_noise)
+        return 0;
+    if(u < 1e-12)
+        u = 1e-12;
+    return sigma * sqrt(-2.0 * log(u)) * cos(2.0 * M_PI * v);
+}
+
+
+//-----------------------------------------------------------------------
+// Arena
+
+void sim_add_wall(double x1, double y1, double x2, double y2)
+{
+    if(sim_wall_count == SIM_WALLS)
+    {
+        fprintf(stderr, "too many walls\n");
+        exit(1);
+    }
+    sim_walls[sim_wall_count].x1 = x1;
+    sim_walls[sim_wall_count].y1 = y1;
+    sim_walls[sim_wall_count].x2 = x2;
+    sim_walls[sim_wall_count].y2 = y2;
+    sim_wall_count++;
+}
+
+void sim_load_arena(const char *name)
+{
+    char line[256], kind[16];
+    double x1, y1, x2, y2;
+    FILE *file = fopen(name, "r");
+
+    if(!file)
+    {
+        perror(name);
+        exit(1);
+    }
+    while(fgets(line, sizeof(line), file))
+    {
+        if(sscanf(line, "%15s %lf %lf %lf %lf", kind, &x1, &y1, &x2, &y2) != 5 || kind[0] == '#')
+            continue;
+        if(!strcmp(kind, "wall"))
+            sim_add_wall(x1, y1, x2, y2);
+        else if(!strcmp(kind, "box"))
+        {
+            sim_add_wall(x1, y1, x2, y1);
+            sim_add_wall(x2, y1, x2, y2);
+            sim_add_wall(x2, y2, x1, y2);
+            sim_add_wall(x1, y2, x1, y1);
+        }
+    }
+    fclose(file);
+}
+
+// Function to return the distance from a point to a wall
+double sim_wall_distance(const sim_wall *wall, double x, double y)
+{
+    double dx = wall->x2 - wall->x1, dy = wall->y2 - wall->y1;
+    double length = dx * dx + dy * dy;
+    double t = length ? ((x - wall->x1) * dx + (y - wall->y1) * dy) / length : 0;
+
+    if(t < 0)
+        t = 0;
+    else if(t > 1)
+        t = 1;
+    return hypot(x - wall->x1 - t * dx, y - wall->y1 - t * dy);
+}
+
+// Function to tell whether the bot fits at (x, y)
+int sim_clear(double x, double y)
+{
+    int i;
+
+    for(i = 0; i < sim_wall_count; i++)
+        if(sim_wall_distance(&sim_walls[i], x, y) < SIM_RADIUS)
+            return 0;
+    return 1;
+}
+
+// Function to return the distance from (x, y) along "angle" to the nearest wall, "limit" if none is closer
+double sim_ray(double x, double y, double angle, double limit)
+{
+    double dx = sin(angle), dy = cos(angle), nearest = limit;
+    double ex, ey, denominator, t, u;
+    int i;
+
+    for(i = 0; i < sim_wall_count; i++)
+    {
+        ex = sim_walls[i].x2 - sim_walls[i].x1;
+        ey = sim_walls[i].y2 - sim_walls[i].y1;
+        denominator = dx * ey - dy * ex;
+        if(fabs(denominator) < 1e-9)
+            continue;
+        t = ((sim_walls[i].x1 - x) * ey - (sim_walls[i].y1 - y) * ex) / denominator;    // Along the ray
+        u = ((sim_walls[i].x1 - x) * dy - (sim_walls[i].y1 - y) * dx) / denominator;    // Along the wall
+        if(t >= 0 && u >= 0 && u <= 1 && t < nearest)
+            nearest = t;
+    }
+    return nearest;
+}
+//-----------------------------------------------------------------------
+
+
+//-----------------------------------------------------------------------
+// Mission
+
+void sim_load_mission(const char *name)
+{
+    char line[256], kind[16];
+    double a, b;
+    int fields;
+    sim_command *command;
+    FILE *file = fopen(name, "r");
+
+    if(!file)
+    {
+        perror(name);
+        exit(1);
+    }
+    while(fgets(line, sizeof(line), file))
+    {
+        a = b = 0;
+        fields = sscanf(line, "%15s %lf %lf", kind, &a, &b);
+        if(fields < 1 || kind[0] == '#')
+            continue;
+        if(sim_command_count == SIM_COMMANDS)
+        {
+            fprintf(stderr, "too many commands\n");
+            exit(1);
+        }
+        command = &sim_commands[sim_command_count++];
+        command->a = a;
+        command->b = b;
+        if(!strcmp(kind, "move"))
+            command->kind = 'm';
+        else if(!strcmp(kind, "rotate"))
+            command->kind = 'r';
+        else if(!strcmp(kind, "stop"))
+            command->kind = 's';
+        else if(!strcmp(kind, "home"))
+            command->kind = 'h';
+        else if(!strcmp(kind, "retrace"))
+            command->kind = 't';
+        else if(!strcmp(kind, "wait"))
+            command->kind = 'w';
+        else if(!strcmp(kind, "key"))
+        {
+            command->kind = 'k';
+            command->a = (sscanf(line, "%*s %c", kind) == 1) ? kind[0] : 0;
+            command->b = (sscanf(line, "%*s %*c %lf", &b) == 1) ? b : 1;
+        }
+        else
+        {
+            fprintf(stderr, "%s: unknown command %s\n", name, kind);
+            exit(1);
+        }
+    }
+    fclose(file);
+}
+
+void sim_send(unsigned char data)
+{
+    sim_rx[sim_rx_head] = data;
+    sim_rx_head = (sim_rx_head + 1) % SIM_RX_QUEUE;
+}
+
+// Function to send a command frame (see command_receive) with "size" bytes of payload
+void sim_send_bytes(unsigned char type, const unsigned char *payload, int size)
+{
+    unsigned char bytes[32];
+    unsigned int crc = 0;
+    int i, length = 0;
+
+    bytes[length++] = size;
+    bytes[length++] = type;
+    bytes[length++] = sim_sequence++;
+    for(i = 0; i < size; i++)
+        bytes[length++] = payload[i];
+
+    sim_send(0xA5);
+    for(i = 0; i < length; i++)
+    {
+        crc = hal_crc_xmodem(crc, bytes[i]);
+        sim_send(bytes[i]);
+    }
+    sim_send(crc >> 8);
+    sim_send(crc & 0xFF);
+}
+
+// Function to send a command frame, "payload" holds 16 bit words
+void sim_send_frame(unsigned char type, const int *payload, int words)
+{
+    unsigned char bytes[16] = {0};
+    int i;
+
+    for(i = 0; i < words; i++)
+    {
+        bytes[2 * i] = payload[i] & 0xFF;
+        bytes[2 * i + 1] = (payload[i] >> 8) & 0xFF;
+    }
+    sim_send_bytes(type, bytes, words * 2);
+}
+
+// Function to send a key of the keyboard control in a KEY frame
+void sim_send_key(unsigned char key)
+{
+    sim_send_bytes(0x09, &key, 1);
+}
+
+// Function to tell whether the firmware has nothing left to do
+int sim_idle()
+{
+    return sim_rx_head == sim_rx_tail && rx_head == rx_tail && !command_busy
+        && motion_mode == 0 && avoid_state == 0 && path_count == 0 && plan_mission == 0
+        && (hal_host_direction & 0x0F) == 0 && fabs(sim_speed[0]) < 0.5 && fabs(sim_speed[1]) < 0.5;
+}
+
+void sim_finish(int done)
+{
+    sim_result result;
+
+    result.done = done;
+    result.time = (sim_started < 0) ? 0 : sim_seconds() - sim_started - (done ? SIM_SETTLE : 0);
+    result.x = sim_x;
+    result.y = sim_y;
+    result.heading = sim_theta * 180.0 / M_PI;
+    result.odometry_error = hypot(current_x / 256.0 - sim_x, current_y / 256.0 - sim_y);
+    result.collisions = sim_collisions;
+    if(write(sim_result_fd, &result, sizeof(result)) != sizeof(result))
+        _exit(1);
+    _exit(0);
+}
+
+// Function to send the next command of the mission once the previous one has finished
+void sim_mission()
+{
+    sim_command *command;
+    int payload[2] = {0, 0};
+    double now = sim_seconds();
+
+    if(now > sim_limit)
+        sim_finish(0);
+    if(now < SIM_BOOT || now < sim_wait_until)
+        return;
+
+    if(!sim_idle())
+    {
+        sim_idle_since = -1;
+        return;
+    }
+    if(sim_idle_since < 0)
+        sim_idle_since = now;
+    if(sim_started >= 0 && now - sim_idle_since < SIM_SETTLE)
+        return;
+
+    if(sim_next == sim_command_count)
+        sim_finish(1);
+
+    if(sim_started < 0)
+        sim_started = now;
+    command = &sim_commands[sim_next++];
+    sim_idle_since = -1;
+    switch(command->kind)
+    {
+        case 'm':
+            payload[0] = (int)lround(command->a * 10);
+            payload[1] = (int)lround(command->b * 10);
+            sim_send_frame(0x01, payload, 2);
+            break;
+        case 'r':
+            payload[0] = (int)lround(command->a * 10);
+            sim_send_frame(0x02, payload, 1);
+            break;
+        case 's':
+            sim_send_frame(0x05, payload, 0);
+            break;
+        case 'k':
+            sim_send_key((unsigned char)command->a);
+            if(--command->b >= 1)
+                sim_next--;                 // The next one once this one is done, a KEY frame sent meanwhile is busy
+            break;
+        case 'h':
+            sim_send_key('7');
+            break;
+        case 't':
+            sim_send_key('9');
+            break;
+        case 'w':
+            sim_wait_until = now + command->a / 1000.0;
+            break;
+    }
+}
+//-----------------------------------------------------------------------
+
+
+//-----------------------------------------------------------------------
+// Hardware
+
+// Function to return the reading of an ADC channel
+unsigned char sim_adc(unsigned char channel)
+{
+    static const double angles[5] = {-90, -45, 0, 45, 90};
+    double angle, x, y, distance, reading;
+
+    if(channel >= 4 && channel <= 13)
+    {
+        angle = sim_theta + angles[(channel - 4) % 5] * M_PI / 180.0;
+        x = sim_x + SIM_SENSOR_RIM * sin(angle);
+        y = sim_y + SIM_SENSOR_RIM * cos(angle);
+        if(channel <= 8)
+            return (sim_ray(x, y, angle, SIM_IR_RANGE) < SIM_IR_RANGE) ? SIM_IR_NEAR : SIM_IR_FAR;
+
+        distance = sim_ray(x, y, angle, SIM_SHARP_MAX) * (1.0 + sim_gauss(SIM_SHARP_SIGMA));
+        if(distance < SIM_SHARP_MIN)
+            distance = SIM_SHARP_MIN;
+        else if(distance > SIM_SHARP_MAX)
+            distance = SIM_SHARP_MAX;
+        reading = pow(10.0 * 2799.6 / (distance * 10.0), 1.0 / 1.1546);        // Inverse of the curve of sharp.h
+        return (reading > 255) ? 255 : (unsigned char)lround(reading);
+    }
+    return (channel == 0) ? 180 : 20;                                          // Battery, white line sensors
+}
+
+// Function to move the bot by one step
+void sim_physics()
+{
+    double duty[2], target, turned[2], ground[2], distance, turn, mid, x, y;
+    unsigned char port = hal_host_direction;
+    int wheel;
+
+    for(wheel = 0; wheel < 2; wheel++)
+    {
+        duty[wheel] = (hal_host_duty[wheel] > HAL_MOTOR_TOP ? HAL_MOTOR_TOP : hal_host_duty[wheel]) / (double)HAL_MOTOR_TOP;
+        target = 0;
+        if(port & (wheel ? 0x04 : 0x02))
+            target = duty[wheel];
+        else if(port & (wheel ? 0x08 : 0x01))
+            target = -duty[wheel];
+        target *= SIM_TOP_SPEED * sim_gain[wheel];
+        sim_speed[wheel] += (target - sim_speed[wheel]) * SIM_DT / SIM_MOTOR_TAU;
+
+        turned[wheel] = sim_speed[wheel] * SIM_DT;
+        ground[wheel] = turned[wheel] * sim_scale[wheel] * (1.0 + sim_gauss(SIM_SLIP_SIGMA));
+        sim_step_travel[wheel] = fabs(turned[wheel]) / SIM_COUNT_CM;
+        sim_travel[wheel] += sim_step_travel[wheel];
+    }
+
+    distance = (ground[0] + ground[1]) / 2;
+    turn = (ground[0] - ground[1]) / SIM_WHEEL_BASE;
+    mid = sim_theta + turn / 2;
+    x = sim_x + distance * sin(mid);
+    y = sim_y + distance * cos(mid);
+    if(sim_clear(x, y))
+    {
+        sim_x = x;
+        sim_y = y;
+        sim_touching = 0;
+    }
+    else if(!sim_touching)
+    {
+        sim_touching = 1;
+        sim_collisions++;
+    }
+    sim_theta += turn;
+}
+
+// Function to call an interrupt routine as the AVR does, with the interrupts off
+void sim_interrupt(void (*vector)(void))
+{
+    hal_host_interrupts = 0;
+    vector();
+    hal_host_interrupts = 1;
+    sim_woken = 1;
+}
+
+// Function to take the interrupts that are due and enabled
+void sim_interrupts(unsigned long long start)
+{
+    unsigned int now = hal_host_clock, guard;
+    double fraction;
+    int wheel;
+
+    if(!hal_host_interrupts)
+        return;
+
+    for(wheel = 0; wheel < 2; wheel++)
+    {
+        while(sim_edges[wheel] + 1 <= sim_travel[wheel] && hal_host_encoders)
+        {
+            sim_edges[wheel]++;
+            fraction = (sim_edges[wheel] - (sim_travel[wheel] - sim_step_travel[wheel])) / sim_step_travel[wheel];
+            hal_host_clock = (fraction > 0 && fraction < 1) ? start + (unsigned int)(SIM_STEP * fraction) : now;
+            sim_interrupt(wheel ? hal_isr_INT5 : hal_isr_INT4);
+        }
+    }
+    hal_host_clock = now;
+
+    if(sim_timer2_pending)
+    {
+        sim_timer2_pending = 0;
+        sim_interrupt(hal_isr_TIMER2_COMPA);
+    }
+    if(sim_timer4_pending)
+    {
+        sim_timer4_pending = 0;
+        sim_interrupt(hal_isr_TIMER4_COMPA);
+    }
+
+    if(sim_adc_pending)
+    {
+        sim_adc_pending = 0;
+        sim_interrupt(hal_isr_ADC);
+    }
+
+    if(sim_rx_head != sim_rx_tail && hal_host_uart_enabled && sim_time - sim_rx_last >= SIM_BYTE_COUNTS)
+    {
+        hal_host_uart_data = sim_rx[sim_rx_tail];
+        sim_rx_tail = (sim_rx_tail + 1) % SIM_RX_QUEUE;
+        sim_rx_last = sim_time;
+        sim_interrupt(hal_isr_USART0_RX);
+    }
+
+    for(guard = 0; hal_host_uart_tx && guard < 256; guard++)
+        sim_interrupt(hal_isr_USART0_UDRE);
+}
+
+// Function to run the bot and its hardware on by one step
+void sim_step()
+{
+    unsigned long long start = hal_host_clock;
+
+    sim_time += SIM_STEP;
+    hal_host_clock += SIM_STEP;
+
+    sim_physics();
+
+    if(hal_host_timers)
+    {
+        sim_timer2 += SIM_STEP;
+        if(sim_timer2 >= HAL_TICK_COUNTS)
+        {
+            sim_timer2 -= HAL_TICK_COUNTS;
+            sim_timer2_pending = 1;
+        }
+        sim_timer4 += SIM_STEP;
+        if(sim_timer4 >= HAL_ODOMETRY_COUNTS)
+        {
+            sim_timer4 -= HAL_ODOMETRY_COUNTS;
+            sim_timer4_pending = 1;
+        }
+    }
+
+    if(hal_host_adc_busy)                                       // The conversion is done
+    {
+        hal_host_adc_result = sim_adc(hal_host_adc_channel);
+        hal_host_adc_busy = 0;
+        sim_adc_pending = 1;
+    }
+
+    sim_interrupts(start);
+    sim_mission();
+
+    if(sim_trace && sim_seconds() >= sim_traced + SIM_TRACE_PERIOD)
+    {
+        sim_traced = sim_seconds();
+        fprintf(stderr, "%7.2f  bot %7.1f %7.1f %6.1f  odometry %7.1f %7.1f %6.1f  port %02X duty %4u %4u  motion %u avoid %u path %u plan %u\n",
+                sim_traced, sim_x, sim_y, sim_theta * 180.0 / M_PI, current_x / 256.0, current_y / 256.0, current_theta * 360.0 / 1408,
+                hal_host_direction, hal_host_duty[0], hal_host_duty[1], motion_mode, avoid_state, path_count, plan_mission);
+    }
+}
+
+void hal_host_sleep(void)
+{
+    sim_woken = 0;
+    while(!sim_woken)
+        sim_step();
+}
+
+void hal_host_delay_us(double us)
+{
+    sim_delay_debt += us * SIM_T1_HZ / 1e6;
+    while(sim_delay_debt >= SIM_STEP)
+    {
+        sim_delay_debt -= SIM_STEP;
+        sim_step();
+    }
+}
+
+// Function to take a byte the firmware sends; nothing is made of it
+void hal_host_uart_send(unsigned char data)
+{
+    (void)data;
+}
+//-----------------------------------------------------------------------
+
+
+// Function to set up the bot for a run
+void sim_start(long seed)
+{
+    int wheel;
+
+    srand48(seed);
+    for(wheel = 0; wheel < 2; wheel++)
+    {
+        sim_gain[wheel] = 1.0 + sim_gauss(SIM_GAIN_SIGMA);
+        sim_scale[wheel] = 1.0 + sim_gauss(SIM_SCALE_SIGMA);
+    }
+    sim_x = sim_y = sim_theta = 0;
+    if(!sim_clear(0, 0))
+    {
+        fprintf(stderr, "the bot does not fit at (0,0)\n");
+        _exit(1);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    const char *arena = "sim/arena.txt", *mission = "sim/mission.txt";
+    int runs = 1, verbose = 0, option, run, pipes[2], status, completed = 0, collisions = 0;
+    long seed = 1;
+    double time_sum = 0, time_max = 0, home_sum = 0, home_max = 0, odometry_sum = 0, home;
+    sim_result result;
+    pid_t pid;
+
+    while((option = getopt(argc, argv, "a:m:n:s:t:qvT")) != -1)
+    {
+        switch(option)
+        {
+            case 'a': arena = optarg; break;
+            case 'm': mission = optarg; break;
+            case 'n': runs = atoi(optarg); break;
+            case 's': seed = atol(optarg); break;
+            case 't': sim_limit = atof(optarg); break;
+            case 'q': sim_noise = 0; break;
+            case 'v': verbose = 1; break;
+            case 'T': sim_trace = 1; break;
+            default:
+                fprintf(stderr, "usage: %s [-a arena] [-m mission] [-n runs] [-s seed] [-t limit s] [-q] [-v] [-T]\n", argv[0]);
+                return 1;
+        }
+    }
+    sim_load_arena(arena);
+    sim_load_mission(mission);
+
+    for(run = 0; run < runs; run++)
+    {
+        if(pipe(pipes))
+        {
+            perror("pipe");
+            return 1;
+        }
+        fflush(stdout);
+        pid = fork();
+        if(pid == 0)
+        {
+            close(pipes[0]);
+            sim_result_fd = pipes[1];
+            sim_start(seed + run);
+            firmware_main();
+            _exit(1);
+        }
+        close(pipes[1]);
+        status = read(pipes[0], &result, sizeof(result));
+        close(pipes[0]);
+        waitpid(pid, NULL, 0);
+        if(status != sizeof(result))
+        {
+            fprintf(stderr, "run %d: the simulator failed\n", run);
+            return 1;
+        }
+
+        home = hypot(result.x, result.y);
+        if(verbose)
+            printf("run %d: %s %.1f s, at (%.1f, %.1f) %.0f deg, %.1f cm from the start, odometry off by %.1f cm, %d collisions\n",
+                   run, result.done ? "done in" : "timed out at", result.time, result.x, result.y, result.heading,
+                   home, result.odometry_error, result.collisions);
+        collisions += result.collisions;
+        if(!result.done)
+            continue;
+        completed++;
+        time_sum += result.time;
+        if(result.time > time_max)
+            time_max = result.time;
+        home_sum += home;
+        if(home > home_max)
+            home_max = home;
+        odometry_sum += result.odometry_error;
+    }
+
+    printf("%d runs, %d completed, %d collisions\n", runs, completed, collisions);
+    if(completed)
+        printf("mission time %.1f s mean, %.1f s max; end %.1f cm from the start mean, %.1f cm max; odometry off by %.1f cm mean\n",
+               time_sum / completed, time_max, home_sum / completed, home_max, odometry_sum / completed);
+    return completed == runs ? 0 : 2;
+}
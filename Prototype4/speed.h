@@ -0,0 +1,71 @@
+/*
+Closed loop wheel speed control.
+
+Each wheel has its own PI controller with a feed forward term. speed_update is called at a fixed
+rate with the speed measured from the encoder edge timestamps (see encoder.h) and returns the PWM
+duty that drives the measured speed towards the target.
+
+Units:
+speeds         - shaft encoder counts per second (0.27 cm per count, see cms_to_counts)
+gains          - Q8 fixed point (256 = 1.0), duty per count/s for kff and kp, duty per count/s per update for ki
+integral       - Q8 duty
+
+Anti-windup: the integral is frozen while the output is saturated in the direction of the error,
+and is itself limited to the duty range.
+*/
+
+#define SPEED_DUTY_MAX MOTOR_DUTY_MAX
+
+typedef struct
+{
+	int kff, kp, ki;				// Q8 gains
+	int target;						// Commanded speed, counts per second
+	int measured;					// Speed at the last update, counts per second
+	long integral;					// Q8 duty
+	unsigned int duty;				// Last output
+} wheel_speed;
+
+
+// Function to convert a speed in cm/s to shaft encoder counts per second (100 / 27 counts per cm)
+int cms_to_counts(int cms)
+{
+	return (long)cms * 100 / 27;
+}
+
+
+// Function to restart a controller from rest, e.g. when the motors have been stopped
+void speed_reset(wheel_speed *wheel)
+{
+	wheel->integral = 0;
+	wheel->measured = 0;
+}
+
+
+// Function to run one control period with the "measured" speed of the wheel, returns the new duty
+unsigned int speed_update(wheel_speed *wheel, int measured)
+{
+	int error;
+	long output;
+
+	wheel->measured = measured;
+
+	error = wheel->target - wheel->measured;
+	output = ((long)wheel->kff * wheel->target + (long)wheel->kp * error + wheel->integral) >> 8;
+
+	if(!((output >= SPEED_DUTY_MAX && error > 0) || (output <= 0 && error < 0)))
+	{
+		wheel->integral += (long)wheel->ki * error;
+		if(wheel->integral > ((long)SPEED_DUTY_MAX << 8))
+			wheel->integral = (long)SPEED_DUTY_MAX << 8;
+		else if(wheel->integral < -((long)SPEED_DUTY_MAX << 8))
+			wheel->integral = -((long)SPEED_DUTY_MAX << 8);
+	}
+
+	if(output > SPEED_DUTY_MAX)
+		output = SPEED_DUTY_MAX;
+	else if(output < 0 || wheel->target == 0)
+		output = 0;
+
+	wheel->duty = output;
+	return wheel->duty;
+}
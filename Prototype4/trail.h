@@ -0,0 +1,138 @@
+/*
+Breadcrumb trail.
+
+Every node the bot forms on the way out (see set_node) is offered to the trail, which keeps the
+corners of the way it came: up to TRAIL_POINTS points (1/256 cm) in a ring, oldest first, starting
+at the origin. When the ring is full the oldest point is dropped and trail_lost is set, so the way
+back ends with a straight line from the oldest point left to the origin.
+
+The nodes are simplified as they come, Douglas-Peucker style: the nodes since the last point kept
+(the anchor) wait in a window of TRAIL_WINDOW. While every waiting node lies within TRAIL_TOLERANCE
+of the line from the anchor to the newest one they are all on one straight leg and none is kept. When
+one strays further, the one furthest from the line is a corner: it is kept, becomes the anchor, and
+the nodes after it are checked again against the new line. When the window is full the nodes on the
+leg are dropped but the newest, which stands for the leg in the later checks.
+A teleoperated run of short nudges along a line is thus one point, and the way back has the fewest stops.
+*/
+
+#define TRAIL_POINTS		32
+#define TRAIL_WINDOW		8
+#define TRAIL_TOLERANCE		5						// cm
+
+long trail_x[TRAIL_POINTS] = {0}, trail_y[TRAIL_POINTS] = {0};
+unsigned char trail_first = 0, trail_count = 1;		// The origin
+unsigned char trail_lost = 0;
+unsigned char trail_recording = 1;					// Cleared while the bot is on its way back
+long trail_window_x[TRAIL_WINDOW], trail_window_y[TRAIL_WINDOW];
+unsigned char trail_window_count = 0;
+
+
+// Function to keep a point at the end of the trail, dropping the oldest one if the trail is full
+void trail_keep(long x, long y)
+{
+	unsigned char i;
+
+	if(trail_count == TRAIL_POINTS)
+	{
+		trail_first = (trail_first + 1) % TRAIL_POINTS;
+		trail_count--;
+		trail_lost = 1;
+	}
+	i = (trail_first + trail_count) % TRAIL_POINTS;
+	trail_x[i] = x;
+	trail_y[i] = y;
+	trail_count++;
+}
+
+
+// Function to return the distance in cm of the point p from the line through a and b, all in 1/256 cm
+unsigned long trail_offset(long ax, long ay, long bx, long by, long px, long py)
+{
+	long dx = (bx - ax) >> 8, dy = (by - ay) >> 8;
+	long ex = (px - ax) >> 8, ey = (py - ay) >> 8;
+	long cross;
+	unsigned int length = isqrt(dx * dx + dy * dy);
+
+	if(!length)
+		return isqrt(ex * ex + ey * ey);
+	cross = dx * ey - dy * ex;
+	return ((cross < 0) ? -cross : cross) / length;
+}
+
+
+// Function to offer a node (1/256 cm) to the trail
+void trail_add(long x, long y)
+{
+	unsigned char i, far, last;
+	unsigned long offset, far_offset;
+	long anchor_x, anchor_y;
+
+	if(!trail_recording)
+		return;
+
+	if(trail_window_count == TRAIL_WINDOW)
+	{
+		trail_window_x[0] = trail_window_x[TRAIL_WINDOW - 1];
+		trail_window_y[0] = trail_window_y[TRAIL_WINDOW - 1];
+		trail_window_count = 1;
+	}
+	trail_window_x[trail_window_count] = x;
+	trail_window_y[trail_window_count] = y;
+	trail_window_count++;
+
+	while(trail_window_count > 1)
+	{
+		last = (trail_first + trail_count - 1) % TRAIL_POINTS;
+		anchor_x = trail_x[last];
+		anchor_y = trail_y[last];
+
+		far_offset = TRAIL_TOLERANCE;
+		far = TRAIL_WINDOW;
+		for(i = 0; i < trail_window_count - 1; i++)
+		{
+			offset = trail_offset(anchor_x, anchor_y, x, y, trail_window_x[i], trail_window_y[i]);
+			if(offset > far_offset)
+			{
+				far_offset = offset;
+				far = i;
+			}
+		}
+		if(far == TRAIL_WINDOW)
+			break;									// One straight leg
+
+		trail_keep(trail_window_x[far], trail_window_y[far]);
+		for(i = far + 1; i < trail_window_count; i++)
+		{
+			trail_window_x[i - far - 1] = trail_window_x[i];
+			trail_window_y[i - far - 1] = trail_window_y[i];
+		}
+		trail_window_count -= far + 1;
+	}
+}
+
+
+// Function to take the newest point off the trail, returns 0 if the trail is empty
+unsigned char trail_pop(long *x, long *y)
+{
+	unsigned char i;
+
+	if(!trail_count)
+		return 0;
+	trail_count--;
+	i = (trail_first + trail_count) % TRAIL_POINTS;
+	*x = trail_x[i];
+	*y = trail_y[i];
+	return 1;
+}
+
+
+// Function to start a new trail at the point (x, y) in 1/256 cm
+void trail_clear(long x, long y)
+{
+	trail_first = 0;
+	trail_count = 1;
+	trail_x[0] = x;
+	trail_y[0] = y;
+	trail_lost = 0;
+	trail_window_count = 0;
+}